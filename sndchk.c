@@ -33,21 +33,47 @@
  *   sndchk                     List devices and show help
  *   sndchk -w                  Monitor default device
  *   sndchk -d N -w             Monitor device pcmN
+ *   sndchk -d all -w           Monitor all devices
  *   sndchk -xruns -w           Monitor only xruns
  *   sndchk -usb -w             Monitor only USB errors and IRQ
  *
  * Build:
- *   cc -o sndchk sndchk.c
+ *   cc -o sndchk sndchk.c -lnv -ldevinfo -lpthread -lm
  *
  * License: BSD-2-Clause
  */
 
 #include <sys/types.h>
-#include <sys/sysctl.h>
+#include <sys/cpuset.h>
+#include <sys/event.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/nv.h>
+#include <sys/resource.h>
+#include <sys/rtprio.h>
+#include <sys/socket.h>
+#include <sys/sndstat.h>
 #include <sys/soundcard.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <netinet/in.h>
+
+#include <dev/usb/usb.h>
+#include <dev/usb/usb_ioctl.h>
 
+#include <devinfo.h>
+
+#include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <pthread_np.h>
+#include <semaphore.h>
+#include <spawn.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -55,25 +81,136 @@
 #include <time.h>
 #include <signal.h>
 #include <errno.h>
+#include <math.h>
+#include <netdb.h>
 #include <regex.h>
+#include <stdarg.h>
+#include <stdint.h>
 
-#define MAX_DEVICES 16
-#define MAX_CHANNELS 8
+#define MIN_CHANNELS 8          /* per device, see channel_capacity() */
 #define MAX_LINE 1024
+#define ARENA_BLOCK (64 * 1024)
+#define CMD_OUTPUT_SIZE (16 * 1024) /* initial exec_cmd() buffer */
 #define IRQ_CALIBRATION_SAMPLES 10
+#define IRQ_BASELINE_TAU 30.0   /* seconds, baseline time constant */
+#define IRQ_SPIKE_WEIGHT 0.25   /* relative baseline update during spikes */
+#define MIN_INTERVAL 0.001
+#define NSEC_PER_SEC 1000000000ULL
+#define DEVD_PIPE "/var/run/devd.seqpacket.pipe"
+#define USB_RESCAN_NS NSEC_PER_SEC /* lookups while a USB device is gone */
+#define RING_SLOTS 256      /* power of two */
+#define TRACE_MAGIC "SNDCHKT1"
+#define TRACE_VERSION 4
+#define TRACE_NAME_LEN 28
+#define TRACE_DEFAULT_MB 64
+#define LAT_SUB_BITS 3          /* 8 linear sub-buckets per power of two */
+#define LAT_BUCKETS (64 << LAT_SUB_BITS)
+#define METRICS_MAX 32768       /* rendered OpenMetrics text */
+#define METRICS_RETRIES 10000   /* reads of a snapshot being rewritten */
+#define HTTP_CLIENTS 4
+#define HTTP_REQUEST_MAX 1024
+#define BUF_LOW_PCT 25          /* -b: report headroom below this */
+#define SHM_NAME "/sndchk"      /* -D snapshot for -q and other readers */
+#define SHM_MAGIC "SNDCHKS1"
+#define SHM_VERSION 1
+#define STRESS_CPU 0x1          /* -s: busy loops on every CPU */
+#define STRESS_MEM 0x2          /* -s: memory copies */
+#define STRESS_USB 0x4          /* -s: control requests to the device */
+#define STRESS_LEVELS 10        /* level N is N * 10% duty cycle */
+#define STRESS_PERIOD_NS 10000000ULL /* duty cycle period, 10 ms */
+#define STRESS_MEM_THREADS 2
+#define STRESS_MEM_MB 64        /* per memory thread */
+#define STRESS_USB_RATE 100     /* control requests/s per level */
+#define STRESS_STEP_DEFAULT 30  /* seconds per level */
+#define SWEEP_PARAMS 2          /* -S options, stepped as a product */
+#define SWEEP_VALUES 16         /* values per sysctl */
+#define SWEEP_SOAK_DEFAULT 60   /* seconds per setting */
+#define SYNTH_IRQ_RATE 8000     /* -A: steady rate of the synthetic controller */
+#define SYNTH_XRUN_EVERY 97     /* -A: ticks between injected events */
+#define SYNTH_ISO_EVERY 131
+#define SYNTH_SPIKE_EVERY 173
+#define SYNTH_RESET_EVERY 1009  /* -A: xrun and interrupt counters restart */
+
+/* Build options, see the Makefile */
+#ifdef WITHOUT_USB
+#define HAVE_USB 0
+#else
+#define HAVE_USB 1
+#endif
+#ifdef WITHOUT_IRQ
+#define HAVE_IRQ 0
+#else
+#define HAVE_IRQ 1
+#endif
+#ifdef WITHOUT_EXPORTER
+#define HAVE_EXPORTER 0
+#else
+#define HAVE_EXPORTER 1
+#endif
+
+#define COLLECTORS_MAX 4
+
+/* Metrics kept in the rollups */
+#define ROLL_XRUNS      0
+#define ROLL_USB_ISO    1   /* isochronous transfer failures */
+#define ROLL_USB_OTHER  2   /* control, bulk and interrupt failures */
+#define ROLL_IRQ        3   /* interrupts of the watched controllers */
+#define ROLL_METRICS    4
+#define ROLL_TIERS      3
 
-/* Global flag for signal handling */
+/* Event sources for incident correlation, in causal order */
+#define EVSRC_IRQ   0
+#define EVSRC_USB   1
+#define EVSRC_XRUN  2
+#define EVSRC_COUNT 3
+
+extern char **environ;
+
+/* Cleared when the watch loop should stop */
 static volatile sig_atomic_t running = 1;
 
+/* One sysctl of a -S sweep */
+struct sweep_param {
+    char name[64];
+    int values[SWEEP_VALUES];
+    int nvalues;
+    int orig;           /* restored at the end */
+};
+
 /* Configuration */
 struct config {
-    int device;
+    int *units;              /* -d list, empty for default */
+    int num_units;
+    int all_units;           /* -d all */
     int play_only;
     int show_xruns;
     int show_usb;
     int watch_mode;
-    int interval;
+    double interval;    /* seconds, may be fractional */
     float irq_threshold;
+    float irq_zscore;   /* minimum z-score for a spike */
+    int threaded;       /* sample in a separate thread */
+    int sampler_cpu;    /* pin sampler to CPU, -1 for no pinning */
+    int sampler_rtprio; /* realtime priority of sampler, -1 for none */
+    const char *record_file;  /* -R: binary trace of every sample */
+    size_t record_mb;         /* size of the trace file */
+    const char *replay_file;  /* -r: analyse a recorded trace */
+    int offline;              /* replay or -A, leave the hardware alone */
+    double corr_window;       /* -c: incident window in seconds, 0 = off */
+    const char *metrics_addr; /* -m: host:port of OpenMetrics exporter */
+    int output;               /* -o: OUTPUT_TEXT, OUTPUT_JSON or OUTPUT_CSV */
+    int verbose;              /* -v: list controllers and interrupts */
+    int bench;                /* -B: calls per collector, 0 = off */
+    uint64_t analysis;        /* -A: samples through the detection, 0 = off */
+    int irq_top;              /* -I: scan all interrupts, show top N */
+    int cpu_attr;             /* -C: attribute incidents to CPUs */
+    double buf_probe;         /* -b: buffer probe period in seconds, 0 = off */
+    int daemon;               /* -D: detach, publish metrics in shared memory */
+    int stress;               /* -s: STRESS_* load to ramp up, 0 = off */
+    double stress_step;       /* -sstep: seconds per stress level */
+    struct sweep_param sweep[SWEEP_PARAMS]; /* -S: sysctls to step through */
+    int nsweep;
+    double soak;              /* -soak: seconds per sweep setting */
 };
 
 /* Device info */
@@ -85,6 +222,7 @@ struct pcm_device {
     char ugen[16];      /* e.g., "0.4" */
     char controller[16]; /* e.g., "xhci0" */
     char irq[16];       /* e.g., "irq64" */
+    int irq_index;      /* slot in hw.intrcnt, -1 if unknown */
     int is_default;
 };
 
@@ -94,6 +232,19 @@ struct channel_xruns {
     int xruns;
 };
 
+/*
+ * Buffer fill of one channel between two ticks (-b).  Headroom is the
+ * data queued for playback, or the free space for recording, over the
+ * hardware and software buffers.
+ */
+struct buf_fill {
+    char name[64];
+    int size;           /* hwbuf + swbuf bytes */
+    int headroom;       /* at the last probe */
+    int min_headroom;   /* lowest since the last tick */
+    int probes;
+};
+
 /* USB stats */
 struct usb_stats {
     int ctrl_fail;
@@ -102,51 +253,636 @@ struct usb_stats {
     int int_fail;
 };
 
-/* Signal handler */
+/* What a USB device is, independent of the address it got */
+struct usb_ident {
+    int known;
+    uint16_t vendor;
+    uint16_t product;
+    char serial[64];    /* empty if the device has none */
+};
+
+/*
+ * USB device shared by the pcm units on it.  node, id, fd, detached and
+ * rescan belong to the sampler, the rest to the reporter.  After the
+ * device comes back on another address, ugen follows node with the
+ * attach sample.
+ */
+struct usb_source {
+    char ugen[16];
+    char label[24];     /* "ugen0.4 " when watching several devices */
+    char node[16];      /* address being sampled */
+    struct usb_ident id;
+    int fd;             /* cached /dev/ugenX.Y descriptor */
+    int native;         /* node opens read/write, else usbconfig */
+    int detached;
+    uint64_t rescan;    /* next look through /dev while gone, no devd */
+    struct usb_stats prev;
+    int down;           /* not responding or detached */
+    uint64_t down_ts;   /* since when */
+};
+
+/* Interrupt source shared by the devices on one controller */
+struct irq_source {
+    char controller[16];
+    char irq[16];
+    int index;          /* slot in hw.intrcnt, -1 if unknown */
+    long prev_count;
+    double mean;        /* EWMA of rate, the baseline */
+    double var;         /* EWMA of squared deviation from mean */
+    int samples;
+    long rate;          /* last rate */
+    unsigned long spikes;
+    double gap;         /* seconds since the last reading, if one failed */
+    int spiked;         /* spike in the current tick */
+    int num;            /* interrupt number for cpuset, -1 if unknown */
+    int cpu;            /* CPU the interrupt is bound to, -1 for any */
+};
+
+/*
+ * Channel names of one device interned to stable slots.  A tick looks a
+ * channel up by its position in the previous tick first, so while the
+ * channel set is unchanged the diff is a linear pass over slot arrays and
+ * the hash is only probed for channels that appeared or moved.
+ */
+struct chan_table {
+    char (*names)[64];  /* slot -> name */
+    int *xruns;         /* slot -> value at last tick */
+    uint64_t *seen;     /* slot -> tick the channel was last present */
+    int *hash;          /* open addressing, slot + 1, 0 = empty */
+    int hash_mask;
+    int num;            /* slots in use */
+    int cap;
+    int *order;         /* sample position -> slot, last tick */
+    int num_order;
+    uint64_t tick;
+    char (*spare_names)[64];    /* for chan_table_compact() */
+    int *spare_xruns;
+};
+
+/* Per-device watch state */
+struct monitor {
+    struct pcm_device *dev;
+    struct chan_table chans;
+    _Atomic int unit;   /* pcm unit sampled, changes on reattach */
+    int usb;            /* USB source, -1 if none */
+    uint64_t rebind;    /* next lookup of unit after a reattach, 0 if bound */
+};
+
+/*
+ * Bump allocator for tables sized once at startup.  Memory is only
+ * returned all at once by arena_free().
+ */
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+};
+
+struct arena {
+    struct arena_block *head;
+};
+
+/* Output of a command, the buffer is kept and reused between calls */
+struct cmd_output {
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+/* Sample record types */
+#define SAMPLE_TICK     0   /* periodic sample of all counters */
+#define SAMPLE_ATTACH   1   /* USB source reattached, usb[] has new counters */
+#define SAMPLE_DETACH   2   /* USB source detached */
+#define SAMPLE_INFO     3   /* SIGINFO, print statistics */
+
+/* Ways to read a metric, chosen at startup by probe_backends() */
+#define BACKEND_NONE    0   /* metric not watched or nothing works */
+#define BACKEND_NATIVE  1   /* sndstat nvlist, USB_DEVICESTATS, hw.intrcnt */
+#define BACKEND_CMD     2   /* sndctl, usbconfig, vmstat -i */
+
+struct backend {
+    int kind;
+    const char *name;
+    double cost_us;     /* one call, measured by the probe */
+};
+
+/* Output formats (-o) */
+#define OUTPUT_TEXT     0
+#define OUTPUT_JSON     1   /* JSON Lines, one object per event */
+#define OUTPUT_CSV      2
+#define OUTPUT_BUFSIZE  (256 * 1024)
+
+/* Raw counters taken in one tick, analysed later by the reporter */
+struct sample {
+    int type;
+    int source;                 /* USB source for attach/detach */
+    char ugen[16];              /* attach: address the device is on */
+    uint64_t ts;                /* CLOCK_MONOTONIC, ns */
+    struct timespec wall;       /* CLOCK_REALTIME */
+    int64_t late;               /* wakeup lateness in ns, -1 if not a tick */
+    int *num_channels;          /* per monitor */
+    struct channel_xruns *channels; /* max_channels per monitor */
+    int *usb_ok;                /* 1 ok, 0 no response, -1 detached */
+    struct usb_stats *usb;
+    long *irq;
+    u_long *intr;               /* -I: whole hw.intrcnt, scan->n entries */
+    int *irq_cpu;               /* -C: binding of each controller interrupt */
+    long *cp_times;             /* -C: kern.cp_times, ncpu * CPUSTATES */
+    int *num_bufs;              /* -b: per monitor */
+    struct buf_fill *bufs;      /* -b: max_channels per monitor */
+};
+
+struct watch;
+
+/*
+ * A kind of source sampled every tick.  The compiled-in collectors are
+ * the static table collectors[], watch_init() picks the ones in use so
+ * the sampler and the reporter just walk that list.
+ */
+struct collector {
+    const char *name;
+    int (*enabled)(const struct watch *w);
+    void (*sample)(struct watch *w, struct sample *smp);
+    void (*initial)(struct watch *w, const struct sample *smp, const char *timestamp);
+    void (*check)(struct watch *w, const struct sample *smp, double elapsed,
+                  const char *timestamp);
+};
+
+/*
+ * Scan of every interrupt source (-I).  Per-source state is kept in
+ * separate arrays so one tick is a straight pass the compiler can
+ * vectorise.
+ */
+struct intr_scan {
+    int n;              /* hw.intrcnt entries at startup */
+    char **names;       /* trimmed copies of hw.intrnames */
+    u_long *prev;
+    double *rate;       /* last tick, per second */
+    double *mean;       /* EWMA baseline as for the USB controller */
+    double *var;
+    double *z;
+    double *peak;
+    uint64_t *total;    /* events since the first sample */
+    uint64_t *spiked;   /* tick of the last spike, 0 = never */
+    double *valid;      /* last tick, 1 with a rate, 0 after a counter restart */
+    uint64_t tick;
+    int samples;
+    double elapsed;     /* seconds covered */
+};
+
+/* Single-producer/single-consumer ring of samples */
+struct sample_ring {
+    struct sample *slots;
+    _Atomic size_t head;        /* next slot to fill, producer only */
+    _Atomic size_t tail;        /* next slot to read, consumer only */
+    _Atomic unsigned dropped;   /* samples lost while the ring was full */
+    _Atomic int done;           /* producer has stopped */
+    sem_t avail;
+    struct sample spare;        /* sampled into while the ring is full */
+};
+
+/*
+ * Binary trace file: a page-aligned header followed by a circular array
+ * of fixed-size records.  The header describes the watched devices so
+ * a trace can be replayed without the hardware.
+ */
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;          /* records */
+    uint64_t count;             /* records written in total */
+    double interval;
+    int32_t play_only;
+    int32_t show_xruns;
+    int32_t show_usb;
+    int32_t num_devices;
+    int32_t max_channels;       /* channel entries per device and record */
+    struct {
+        int32_t unit;
+        int32_t is_usb;
+        char desc[256];
+        char ugen[16];
+        char controller[16];
+        char irq[16];
+    } devices[];                /* num_devices entries */
+};
+
+/* Fixed part of a trace record, per-source data follows */
+struct trace_record {
+    uint64_t ts;
+    int64_t wall_sec;
+    int32_t wall_nsec;
+    int16_t type;
+    int16_t source;
+    int64_t late;
+    char ugen[16];
+};
+
+/* Channel entry in a trace record */
+struct trace_channel {
+    int32_t xruns;
+    char name[TRACE_NAME_LEN];
+};
+
+/* USB entry in a trace record */
+struct trace_usb {
+    int32_t ok;
+    struct usb_stats stats;
+};
+
+/* Log-bucketed histogram of wakeup lateness in microseconds */
+struct latency_hist {
+    uint64_t buckets[LAT_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+/* One bucket of a rollup tier, covering a whole second, minute or hour */
+struct rollup_bucket {
+    int64_t id;                 /* start time / tier width, -1 if unused */
+    double sum[ROLL_METRICS];   /* events in the bucket */
+    double max[ROLL_METRICS];   /* highest rate of one tick, per second */
+    unsigned spikes;            /* IRQ spikes */
+    unsigned ticks;
+    double secs;                /* time covered by the ticks */
+};
+
+/* Ring of buckets of one width, kept for a fixed span */
+struct rollup_tier {
+    const char *name;
+    int width;                  /* seconds */
+    int quiet;                  /* only show buckets with events */
+    int cur;                    /* bucket of the last tick */
+    struct rollup_bucket buckets[60];
+    int nbuckets;
+};
+
+/* Per-tick event counts folded into the 1 s, 1 min and 1 h tiers */
+struct rollups {
+    double tick[ROLL_METRICS];  /* counted during the current tick */
+    unsigned tick_spikes;
+    double total[ROLL_METRICS]; /* since the start */
+    unsigned long total_spikes;
+    struct rollup_tier tiers[ROLL_TIERS];
+};
+
+/* Events from all sources that fall into one correlation window */
+struct incident {
+    int open;
+    uint64_t start;                 /* monotonic time of first event */
+    struct timespec wall;
+    uint64_t first[EVSRC_COUNT];    /* first event per source */
+    int count[EVSRC_COUNT];         /* events per source */
+    char desc[EVSRC_COUNT][64];     /* description of first event */
+};
+
+/*
+ * OpenMetrics text, rendered by the reporter after every sample and
+ * copied out by the HTTP server under a sequence lock.
+ */
+struct metrics_buf {
+    _Atomic unsigned seq;       /* odd while being rewritten */
+    size_t len;
+    char data[METRICS_MAX];
+};
+
+#ifndef WITHOUT_EXPORTER
+/* Connection to the exporter, served without blocking */
+struct http_client {
+    int fd;                     /* -1 when the slot is free */
+    size_t in_len;
+    size_t out_len;
+    size_t out_off;
+    char in[HTTP_REQUEST_MAX];
+    char out[METRICS_MAX + 256];
+};
+
+/* Prometheus/OpenMetrics exporter */
+struct exporter {
+    int listen_fd;
+    struct metrics_buf *metrics;
+    struct http_client clients[HTTP_CLIENTS];
+};
+#endif
+
+/*
+ * Shared memory published by -D.  Readers map it and copy the metrics
+ * under the seqlock, the daemon never waits for them.
+ */
+struct shm_segment {
+    char magic[8];
+    uint32_t version;
+    pid_t pid;
+    struct metrics_buf metrics;
+};
+
+/*
+ * Load generator for -s.  Workers read the level and run a duty cycle
+ * of level / STRESS_LEVELS in every STRESS_PERIOD_NS, the reporter
+ * raises the level one step at a time.
+ */
+struct stress {
+    _Atomic int level;
+    _Atomic int stop;
+    int kinds;
+    int ncpu;
+#ifndef WITHOUT_USB
+    char ugen[16];              /* device for STRESS_USB */
+#endif
+    pthread_t *threads;
+    int nthreads;
+    uint64_t step_ns;
+    uint64_t step_start;        /* CLOCK_MONOTONIC of the last step */
+    int xrun_level;             /* level at the first xrun, -1 if none */
+    int iso_level;              /* level at the first ISO failure, -1 if none */
+};
+
+/* Rates seen with one combination of sweep values */
+struct sweep_row {
+    double xruns;
+    double iso_fail;
+    double secs;
+};
+
+/* Tunables sweep for -S, stepped by the reporter like the stress levels */
+struct sweep {
+    struct sweep_param *params;
+    int nparams;
+    int nsteps;         /* product of the value counts */
+    int step;
+    uint64_t soak_ns;
+    uint64_t step_start;
+    struct sweep_row *rows;
+    int active;         /* sysctls are changed and need restoring */
+};
+
+/* Mapped trace file */
+struct trace {
+    struct trace_header *hdr;
+    char *records;
+    size_t map_len;
+    int fd;
+};
+
+/* Watch loop state shared by sampler and reporter */
+struct watch {
+    struct config *cfg;
+    struct arena arena;     /* tables below and all samples */
+    struct monitor *mons;
+    int num_mons;
+    struct usb_source *usbs;
+    int num_usb;
+    struct irq_source *irqs;
+    int num_irq;
+    int max_channels;       /* channel slots per monitor in a sample */
+    int *prev_xruns;        /* scratch for check_xruns(), max_channels */
+    struct backend xruns_be;
+    struct backend usb_be;
+    struct backend irq_be;
+    struct intr_scan *scan;     /* -I, NULL if off */
+    int ncpu;                   /* -C: CPUs in kern.cp_times, 0 if off */
+    long *prev_cp_times;
+    double *cpu_busy;           /* -C: last tick, percent */
+    double *cpu_intr;
+    int *num_bufs;              /* -b: filled by probes, sampler side */
+    struct buf_fill *bufs;
+    struct buf_fill *buf_worst; /* -b: lowest per channel, reporter side */
+    int *num_worst;
+    int xrun_tick;              /* xruns reported in this sample */
+    unsigned long resets;       /* counters that started again */
+    int msec;               /* millisecond timestamps */
+    uint64_t period;        /* ns */
+    uint64_t prev_ts;       /* monotonic time of previous tick */
+    int started;            /* initial values printed */
+    int devd_fd;
+    int kq;
+    struct sample_ring ring;
+    struct trace *trace;    /* recording, NULL if off */
+    uint64_t now;           /* monotonic time of sample being reported */
+    struct incident incident;
+    uint64_t deadline;      /* intended time of the last timer tick */
+    struct latency_hist lat;
+    struct rollups roll;
+#ifndef WITHOUT_EXPORTER
+    struct exporter *exporter;  /* -m, NULL if off */
+#endif
+    struct shm_segment *shm;    /* -D, NULL if off */
+    struct stress *stress;      /* -s, NULL if off */
+    struct sweep *sweep;        /* -S, NULL if off */
+    const struct collector *active[COLLECTORS_MAX];
+    int num_active;
+    struct metrics_buf *metrics; /* rendered for -m and -D, NULL if neither */
+    FILE *info;             /* banners, stderr when stdout carries records */
+};
+
+/* Interrupt counters (hw.intrnames / hw.intrcnt) */
+struct intr_table {
+    char *names;        /* packed NUL-terminated names */
+    size_t names_len;
+    u_long *counts;     /* last hw.intrcnt snapshot */
+    size_t counts_len;  /* size of counts in bytes */
+    int nintr;
+};
+
+static struct intr_table intrtab;
+
+/* Sysctl read every tick, the name is resolved to a MIB once */
+struct sysctl_node {
+    const char *name;
+    int mib[CTL_MAXNAME];
+    u_int miblen;       /* 0 until resolved */
+};
+
+static struct sysctl_node oid_intrcnt = { .name = "hw.intrcnt" };
+static struct sysctl_node oid_cp_times = { .name = "kern.cp_times" };
+
+/* Output of the last exec_cmd(), commands run in one thread at a time */
+static struct cmd_output cmdout;
+
+/* Commands started by exec_cmd(), for the benchmark */
+static unsigned long cmd_spawns;
+
+/* Device of interest in the newbus tree (pcm, uaudio or usbus) */
+struct topo_node {
+    char name[32];      /* e.g. "uaudio0" */
+    char parent[32];    /* e.g. "uhub1" */
+    char ugen[16];      /* from the location of uaudio, e.g. "0.4" */
+};
+
+/*
+ * Snapshot of the device tree taken with one libdevinfo(3) pass, from
+ * which pcm -> uaudio -> ugen -> usbus -> controller is resolved.
+ */
+struct topology {
+    struct topo_node *nodes;
+    int num;
+    int cap;
+    int state;          /* 0 = not loaded, 1 = loaded, -1 = unavailable */
+};
+
+static struct topology topo;
+
+/* Cached /dev/sndstat handle for channel queries */
+struct sndstat {
+    int fd;
+    void *buf;          /* packed nvlist from SNDSTIOC_GET_DEVS */
+    size_t buflen;
+    int no_chan_info;   /* kernel lacks ioctls or channel xruns */
+};
+
+static struct sndstat sndst = { .fd = -1 };
+
+/* Format wall-clock time as string, optionally with milliseconds */
 static void
-sigint_handler(int sig __unused)
+format_timestamp(char *buf, size_t len, const struct timespec *ts, int msec)
+{
+    struct tm tm_info;
+    size_t n;
+
+    localtime_r(&ts->tv_sec, &tm_info);
+    n = strftime(buf, len, "%H:%M:%S", &tm_info);
+
+    if (msec && n > 0)
+        snprintf(buf + n, len - n, ".%03ld", ts->tv_nsec / 1000000);
+}
+
+/* Get monotonic time in nanoseconds */
+static uint64_t
+mono_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Allocate zeroed memory from the arena, NULL when out of memory */
+static void *
+arena_alloc(struct arena *a, size_t size)
 {
-    running = 0;
+    struct arena_block *b = a->head;
+    void *p;
+
+    size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+
+    if (b == NULL || b->size - b->used < size) {
+        size_t bsize = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+
+        if ((b = malloc(sizeof(*b) + bsize)) == NULL)
+            return NULL;
+        b->size = bsize;
+        b->used = 0;
+        b->next = a->head;
+        a->head = b;
+    }
+
+    p = (char *)b->data + b->used;
+    b->used += size;
+    memset(p, 0, size);
+    return p;
 }
 
-/* Get current timestamp as string */
+/* Release everything allocated from the arena */
 static void
-get_timestamp(char *buf, size_t len)
+arena_free(struct arena *a)
 {
-    time_t now;
-    struct tm *tm_info;
+    struct arena_block *b, *next;
 
-    time(&now);
-    tm_info = localtime(&now);
-    strftime(buf, len, "%H:%M:%S", tm_info);
+    for (b = a->head; b != NULL; b = next) {
+        next = b->next;
+        free(b);
+    }
+    a->head = NULL;
 }
 
-/* Execute command and capture output */
+/*
+ * Run a command without a shell and read all of its output with read(2)
+ * into one buffer.  The buffer is allocated once, grows only when the
+ * output doesn't fit and is reused by the next call.  out->buf is
+ * NUL-terminated; stderr of the command is discarded.
+ */
 static int
-exec_cmd(const char *cmd, char *output, size_t outlen)
+exec_cmd(char *const argv[], struct cmd_output *out)
 {
-    FILE *fp;
-    size_t total = 0;
-    char buf[256];
+    posix_spawn_file_actions_t fa;
+    int pfd[2];
+    pid_t pid;
+    ssize_t n;
+    int status, err;
 
-    output[0] = '\0';
-    
-    fp = popen(cmd, "r");
-    if (fp == NULL)
+    out->len = 0;
+    if (out->cap == 0) {
+        if ((out->buf = malloc(CMD_OUTPUT_SIZE)) == NULL)
+            return -1;
+        out->cap = CMD_OUTPUT_SIZE;
+    }
+    out->buf[0] = '\0';
+
+    if (pipe2(pfd, O_CLOEXEC) < 0)
+        return -1;
+
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, pfd[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    err = posix_spawnp(&pid, argv[0], &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    cmd_spawns++;
+    close(pfd[1]);
+
+    if (err != 0) {
+        close(pfd[0]);
+        errno = err;
         return -1;
+    }
+
+    for (;;) {
+        if (out->cap - out->len < 1024) {
+            char *buf = realloc(out->buf, out->cap * 2);
 
-    while (fgets(buf, sizeof(buf), fp) != NULL) {
-        size_t len = strlen(buf);
-        if (total + len < outlen - 1) {
-            strcat(output, buf);
-            total += len;
+            if (buf == NULL)
+                break;
+            out->buf = buf;
+            out->cap *= 2;
         }
+
+        n = read(pfd[0], out->buf + out->len, out->cap - out->len - 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        out->len += n;
     }
+    out->buf[out->len] = '\0';
+    close(pfd[0]);
 
-    pclose(fp);
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
     return 0;
 }
 
+/*
+ * Step to the next line of command output.  Returns the line start and
+ * its length without the newline, NULL at the end.  Lines are not copied
+ * or terminated.
+ */
+static const char *
+next_line(const char **pos, const char *end, size_t *len)
+{
+    const char *line = *pos;
+    const char *nl;
+
+    if (line >= end)
+        return NULL;
+
+    nl = memchr(line, '\n', end - line);
+    *len = (nl != NULL ? nl : end) - line;
+    *pos = nl != NULL ? nl + 1 : end;
+    return line;
+}
+
 /* Get sysctl string value */
 static int
 sysctl_get_string(const char *name, char *buf, size_t len)
@@ -173,6 +909,13 @@ sysctl_get_int(const char *name)
     return val;
 }
 
+/* Set sysctl integer value */
+static int
+sysctl_set_int(const char *name, int val)
+{
+    return sysctlbyname(name, NULL, NULL, &val, sizeof(val));
+}
+
 /* Get default audio unit */
 static int
 get_default_unit(void)
@@ -225,473 +968,5347 @@ find_usb_for_pcm(int unit, char *ugen, size_t ugen_len)
     return 0;
 }
 
-/* Find USB controller for ugen device */
-static int
-find_usb_controller(const char *ugen, char *controller, size_t ctrl_len,
-                    char *irq, size_t irq_len)
+/* Read a variable-sized sysctl into a malloc'd buffer */
+static void *
+sysctl_get_alloc(const char *name, size_t *lenp)
 {
-    char sysctl_name[64];
-    char parent[64];
-    char cmd[128];
-    char output[1024];
-    char *line, *p;
-    int bus;
+    void *buf = NULL;
+    size_t len;
 
-    /* Extract bus number from ugen (e.g., "0.4" -> 0) */
-    bus = atoi(ugen);
+    for (;;) {
+        if (sysctlbyname(name, NULL, &len, NULL, 0) < 0)
+            break;
 
-    /* Get parent of usbus (e.g., xhci0) */
-    snprintf(sysctl_name, sizeof(sysctl_name), "dev.usbus.%d.%%parent", bus);
-    if (sysctl_get_string(sysctl_name, parent, sizeof(parent)) < 0)
-        return -1;
+        /* Leave room in case the table grows between the two calls */
+        len += len / 8;
+        free(buf);
+        if ((buf = malloc(len)) == NULL)
+            return NULL;
 
-    /* Remove trailing newline if any */
-    p = strchr(parent, '\n');
-    if (p) *p = '\0';
+        if (sysctlbyname(name, buf, &len, NULL, 0) == 0) {
+            *lenp = len;
+            return buf;
+        }
+        if (errno != ENOMEM)
+            break;
+    }
 
-    strncpy(controller, parent, ctrl_len - 1);
-    controller[ctrl_len - 1] = '\0';
+    free(buf);
+    return NULL;
+}
 
-    /* Find IRQ in vmstat -i output */
-    snprintf(cmd, sizeof(cmd), "vmstat -i | grep '%s'", controller);
-    if (exec_cmd(cmd, output, sizeof(output)) < 0)
-        return -1;
+/*
+ * Read a sysctl by its cached MIB, which saves the kernel the name
+ * lookup of sysctlbyname() on every call.
+ */
+static int
+sysctl_node_get(struct sysctl_node *n, void *buf, size_t *len)
+{
+    if (n->miblen == 0) {
+        size_t miblen = CTL_MAXNAME;
 
-    /* Parse first field (e.g., "irq64:") */
-    line = output;
-    p = strchr(line, ':');
-    if (p == NULL)
-        return -1;
+        if (sysctlnametomib(n->name, n->mib, &miblen) < 0)
+            return sysctlbyname(n->name, buf, len, NULL, 0);
+        n->miblen = miblen;
+    }
 
-    *p = '\0';
-    
-    /* Skip leading whitespace */
-    while (*line == ' ' || *line == '\t')
-        line++;
+    return sysctl(n->mib, n->miblen, buf, len, NULL, 0);
+}
+
+/* Load interrupt names and counters, done once at startup */
+static int
+intr_table_load(struct intr_table *t)
+{
+    free(t->names);
+    free(t->counts);
+    memset(t, 0, sizeof(*t));
+
+    t->names = sysctl_get_alloc("hw.intrnames", &t->names_len);
+    if (t->names == NULL)
+        return -1;
 
-    strncpy(irq, line, irq_len - 1);
-    irq[irq_len - 1] = '\0';
+    t->counts = sysctl_get_alloc("hw.intrcnt", &t->counts_len);
+    if (t->counts == NULL) {
+        free(t->names);
+        t->names = NULL;
+        return -1;
+    }
 
+    t->nintr = t->counts_len / sizeof(u_long);
     return 0;
 }
 
-/* Get IRQ count from vmstat -i */
-static long
-get_irq_count(const char *irq)
+/* Refresh counters with a single sysctl */
+static int
+intr_table_refresh(struct intr_table *t)
 {
-    char cmd[128];
-    char output[256];
-    char *p;
-    long count = 0;
+    size_t len = t->counts_len;
 
-    snprintf(cmd, sizeof(cmd), "vmstat -i | grep '%s:'", irq);
-    if (exec_cmd(cmd, output, sizeof(output)) < 0)
-        return 0;
+    if (t->counts == NULL)
+        return -1;
 
-    /* Parse third field (total count) */
-    /* Format: "irq64: xhci0    12345    100" */
-    p = output;
-    
-    /* Skip first field (irq) */
-    while (*p && *p != ' ' && *p != '\t') p++;
-    while (*p == ' ' || *p == '\t') p++;
-    
-    /* Skip second field (controller name) */
-    while (*p && *p != ' ' && *p != '\t') p++;
-    while (*p == ' ' || *p == '\t') p++;
-    
-    /* Third field is count */
-    count = strtol(p, NULL, 10);
+    if (sysctl_node_get(&oid_intrcnt, t->counts, &len) < 0) {
+        /* New interrupt sources were added, reload the whole table */
+        if (errno == ENOMEM)
+            return intr_table_load(t);
+        return -1;
+    }
 
-    return count;
+    return 0;
 }
 
-/* Get xruns for a device */
+/*
+ * Find interrupt whose name mentions the given device (e.g., "xhci0") and
+ * return its index.  Names look like "irq64: xhci0", padded with spaces.
+ */
 static int
-get_xruns(int unit, int play_only, struct channel_xruns *channels, int max_channels)
+intr_table_find(const struct intr_table *t, const char *devname,
+                char *irq, size_t irq_len)
 {
-    char cmd[128];
-    char output[4096];
-    char *line, *saveptr;
-    int count = 0;
+    const char *name = t->names;
+    const char *end = t->names + t->names_len;
+    size_t dlen = strlen(devname);
 
-    snprintf(cmd, sizeof(cmd), "sndctl -f /dev/dsp%d -v -o 2>/dev/null", unit);
-    if (exec_cmd(cmd, output, sizeof(output)) < 0)
-        return 0;
-
-    line = strtok_r(output, "\n", &saveptr);
-    while (line != NULL && count < max_channels) {
-        char *xruns_ptr = strstr(line, "xruns=");
-        if (xruns_ptr != NULL) {
-            /* Check play_only filter */
-            if (play_only && strstr(line, "play") == NULL) {
-                line = strtok_r(NULL, "\n", &saveptr);
-                continue;
-            }
+    for (int i = 0; i < t->nintr && name < end; i++) {
+        const char *p = name;
 
-            /* Extract channel name (remove .xruns=N) */
-            char *dot = strstr(line, ".xruns=");
-            if (dot) {
-                size_t name_len = dot - line;
-                if (name_len >= sizeof(channels[count].name))
-                    name_len = sizeof(channels[count].name) - 1;
-                
-                strncpy(channels[count].name, line, name_len);
-                channels[count].name[name_len] = '\0';
-                
-                /* Convert dsp to pcm */
-                if (strncmp(channels[count].name, "dsp", 3) == 0) {
-                    channels[count].name[0] = 'p';
-                    channels[count].name[1] = 'c';
-                    channels[count].name[2] = 'm';
-                }
-            }
+        while ((p = strstr(p, devname)) != NULL) {
+            /* Don't let xhci1 match xhci10 */
+            if (p[dlen] < '0' || p[dlen] > '9')
+                break;
+            p += dlen;
+        }
 
-            /* Extract xruns value */
-            channels[count].xruns = atoi(xruns_ptr + 6);
-            count++;
+        if (p != NULL) {
+            size_t len = strcspn(name, ":");
+            if (len >= irq_len)
+                len = irq_len - 1;
+            memcpy(irq, name, len);
+            irq[len] = '\0';
+            return i;
         }
-        line = strtok_r(NULL, "\n", &saveptr);
+
+        name += strlen(name) + 1;
     }
 
-    return count;
+    return -1;
 }
 
-/* Get USB stats */
+/* Find the interrupt of a USB controller (e.g., "xhci0" -> "irq64") */
 static int
-get_usb_stats(const char *ugen, struct usb_stats *stats)
+find_controller_irq(const char *controller, char *irq, size_t irq_len,
+                    int *irq_index)
 {
-    char cmd[128];
-    char output[2048];
-    char *line, *saveptr;
+    static char *const argv[] = { "vmstat", "-i", NULL };
+    size_t clen = strlen(controller);
+    const char *pos, *end, *line;
+    size_t len;
 
-    memset(stats, 0, sizeof(*stats));
+    *irq_index = -1;
 
-    snprintf(cmd, sizeof(cmd), "usbconfig -d %s dump_stats 2>/dev/null", ugen);
-    if (exec_cmd(cmd, output, sizeof(output)) < 0)
-        return -1;
+    /* Look the controller up in the interrupt table */
+    if (intrtab.names != NULL || intr_table_load(&intrtab) == 0) {
+        *irq_index = intr_table_find(&intrtab, controller, irq, irq_len);
+        if (*irq_index >= 0)
+            return 0;
+    }
 
-    if (strlen(output) == 0)
+    /* Fall back to vmstat -i output: "irq64: xhci0     12345    100" */
+    if (exec_cmd(argv, &cmdout) < 0)
         return -1;
 
-    line = strtok_r(output, "\n", &saveptr);
-    while (line != NULL) {
-        char *p;
-        
-        if ((p = strstr(line, "UE_CONTROL_FAIL:")) != NULL) {
-            stats->ctrl_fail = atoi(p + 16);
-        } else if ((p = strstr(line, "UE_ISOCHRONOUS_FAIL:")) != NULL) {
-            stats->iso_fail = atoi(p + 20);
-        } else if ((p = strstr(line, "UE_BULK_FAIL:")) != NULL) {
-            stats->bulk_fail = atoi(p + 13);
-        } else if ((p = strstr(line, "UE_INTERRUPT_FAIL:")) != NULL) {
-            stats->int_fail = atoi(p + 18);
-        }
+    pos = cmdout.buf;
+    end = cmdout.buf + cmdout.len;
+    while ((line = next_line(&pos, end, &len)) != NULL) {
+        const char *p = memmem(line, len, controller, clen);
+        const char *colon;
+
+        /* Don't let xhci1 match xhci10 */
+        if (p == NULL || (p + clen < line + len && p[clen] >= '0' && p[clen] <= '9'))
+            continue;
+        if ((colon = memchr(line, ':', len)) == NULL || colon > p)
+            continue;
 
-        line = strtok_r(NULL, "\n", &saveptr);
+        while (line < colon && (*line == ' ' || *line == '\t'))
+            line++;
+        snprintf(irq, irq_len, "%.*s", (int)(colon - line), line);
+        return 0;
     }
 
-    return 0;
+    return -1;
 }
 
-/* List available audio devices */
+/* Find USB controller for ugen device */
 static int
-list_devices(struct pcm_device *devices, int max_devices)
+find_usb_controller(const char *ugen, char *controller, size_t ctrl_len,
+                    char *irq, size_t irq_len, int *irq_index)
 {
-    FILE *fp;
-    char line[512];
-    int count = 0;
-    int default_unit = get_default_unit();
-
-    fp = fopen("/dev/sndstat", "r");
-    if (fp == NULL) {
-        perror("Cannot open /dev/sndstat");
-        return 0;
-    }
+    char sysctl_name[64];
+    char parent[64];
+    char *p;
+    int bus;
 
-    while (fgets(line, sizeof(line), fp) != NULL && count < max_devices) {
-        if (strncmp(line, "pcm", 3) != 0)
-            continue;
+    *irq_index = -1;
 
-        struct pcm_device *dev = &devices[count];
-        memset(dev, 0, sizeof(*dev));
+    /* Extract bus number from ugen (e.g., "0.4" -> 0) */
+    bus = atoi(ugen);
 
-        /* Parse unit number */
-        dev->unit = atoi(line + 3);
+    /* Get parent of usbus (e.g., xhci0) */
+    snprintf(sysctl_name, sizeof(sysctl_name), "dev.usbus.%d.%%parent", bus);
+    if (sysctl_get_string(sysctl_name, parent, sizeof(parent)) < 0)
+        return -1;
+
+    /* Remove trailing newline if any */
+    p = strchr(parent, '\n');
+    if (p) *p = '\0';
+
+    strncpy(controller, parent, ctrl_len - 1);
+    controller[ctrl_len - 1] = '\0';
+
+    return find_controller_irq(controller, irq, irq_len, irq_index);
+}
+
+/* Remember pcm, uaudio and usbus devices while walking the tree */
+static int
+topology_walk(struct devinfo_dev *dev, void *arg)
+{
+    struct topology *t = arg;
+
+    if (dev->dd_name != NULL &&
+        (strncmp(dev->dd_name, "pcm", 3) == 0 ||
+         strncmp(dev->dd_name, "uaudio", 6) == 0 ||
+         strncmp(dev->dd_name, "usbus", 5) == 0)) {
+        struct devinfo_dev *parent = devinfo_handle_to_device(dev->dd_parent);
+        struct topo_node *n;
+        const char *p;
+
+        if (t->num == t->cap) {
+            int cap = t->cap > 0 ? t->cap * 2 : 32;
+            struct topo_node *nodes = realloc(t->nodes, cap * sizeof(*nodes));
+
+            if (nodes == NULL)
+                return 1;
+            t->nodes = nodes;
+            t->cap = cap;
+        }
+
+        n = &t->nodes[t->num++];
+        memset(n, 0, sizeof(*n));
+        snprintf(n->name, sizeof(n->name), "%s", dev->dd_name);
+        if (parent != NULL && parent->dd_name != NULL)
+            snprintf(n->parent, sizeof(n->parent), "%s", parent->dd_name);
+
+        /* Location: "bus=0 hubaddr=1 port=3 devaddr=4 interface=1 ugen=ugen0.4" */
+        if (dev->dd_location != NULL &&
+            (p = strstr(dev->dd_location, "ugen=ugen")) != NULL)
+            snprintf(n->ugen, sizeof(n->ugen), "%.*s",
+                     (int)strcspn(p + 9, " "), p + 9);
+    }
+
+    return devinfo_foreach_device_child(dev, topology_walk, arg);
+}
+
+/* Take the device tree snapshot */
+static int
+topology_load(struct topology *t)
+{
+    struct devinfo_dev *root;
+    int err;
+
+    t->num = 0;
+    if (devinfo_init() != 0) {
+        t->state = -1;
+        return -1;
+    }
+
+    root = devinfo_handle_to_device(DEVINFO_ROOT_DEVICE);
+    err = root != NULL ? devinfo_foreach_device_child(root, topology_walk, t) : 1;
+    devinfo_free();
+
+    t->state = err == 0 ? 1 : -1;
+    return err == 0 ? 0 : -1;
+}
+
+/* Drop the snapshot after attach/detach, the next lookup reloads it */
+static void
+topology_invalidate(struct topology *t)
+{
+    if (t->state > 0)
+        t->state = 0;
+}
+
+/* Look up a device of the snapshot by name */
+static const struct topo_node *
+topology_find(const struct topology *t, const char *name)
+{
+    for (int i = 0; i < t->num; i++) {
+        if (strcmp(t->nodes[i].name, name) == 0)
+            return &t->nodes[i];
+    }
+
+    return NULL;
+}
+
+/* Unit of the nth pcm device on USB device ugen, -1 if not attached (yet) */
+static int
+topology_find_pcm(const struct topology *t, const char *ugen, int nth)
+{
+    for (int i = 0; i < t->num; i++) {
+        const struct topo_node *n = &t->nodes[i];
+        const struct topo_node *p;
+
+        if (strncmp(n->name, "pcm", 3) != 0 || strncmp(n->parent, "uaudio", 6) != 0 ||
+            (p = topology_find(t, n->parent)) == NULL || strcmp(p->ugen, ugen) != 0)
+            continue;
+        if (nth-- == 0)
+            return atoi(n->name + 3);
+    }
+
+    return -1;
+}
+
+/*
+ * Resolve where a pcm device sits: its USB device and, with full set,
+ * the controller and its interrupt.  The controller lookup reads the
+ * interrupt table, so it is only done for watched or -v listed devices.
+ * Falls back to per-device sysctls when libdevinfo isn't usable.
+ */
+static void
+resolve_device(struct pcm_device *dev, int full)
+{
+    const struct topo_node *n;
+    char name[32];
+
+    if (topo.state == 0)
+        topology_load(&topo);
+
+    if (!dev->is_usb) {
+        if (topo.state > 0) {
+            snprintf(name, sizeof(name), "pcm%d", dev->unit);
+            if ((n = topology_find(&topo, name)) != NULL) {
+                snprintf(dev->parent, sizeof(dev->parent), "%s", n->parent);
+                if (strncmp(n->parent, "uaudio", 6) == 0 &&
+                    (n = topology_find(&topo, n->parent)) != NULL && n->ugen[0] != '\0') {
+                    snprintf(dev->ugen, sizeof(dev->ugen), "%s", n->ugen);
+                    dev->is_usb = 1;
+                }
+            }
+        } else if (find_usb_for_pcm(dev->unit, dev->ugen, sizeof(dev->ugen)) == 0) {
+            dev->is_usb = 1;
+        }
+    }
+
+    if (!full || !dev->is_usb || dev->controller[0] != '\0')
+        return;
+
+    snprintf(name, sizeof(name), "usbus%d", atoi(dev->ugen));
+    if (topo.state > 0 && (n = topology_find(&topo, name)) != NULL && n->parent[0] != '\0') {
+        snprintf(dev->controller, sizeof(dev->controller), "%s", n->parent);
+        find_controller_irq(dev->controller, dev->irq, sizeof(dev->irq), &dev->irq_index);
+    } else {
+        find_usb_controller(dev->ugen, dev->controller, sizeof(dev->controller),
+                            dev->irq, sizeof(dev->irq), &dev->irq_index);
+    }
+}
+
+/*
+ * Get IRQ count from vmstat -i.  The total is the next to last field,
+ * so names containing spaces ("irq16: hdac0 uhci0+") don't matter.
+ */
+static long
+get_irq_count_cmd(const char *irq)
+{
+    static char *const argv[] = { "vmstat", "-i", NULL };
+    size_t ilen = strlen(irq);
+    const char *pos, *end, *line;
+    size_t len;
+
+    if (exec_cmd(argv, &cmdout) < 0)
+        return 0;
+
+    pos = cmdout.buf;
+    end = cmdout.buf + cmdout.len;
+    while ((line = next_line(&pos, end, &len)) != NULL) {
+        const char *p = line;
+        const char *e = line + len;
+
+        while (p < e && (*p == ' ' || *p == '\t'))
+            p++;
+        if ((size_t)(e - p) <= ilen || memcmp(p, irq, ilen) != 0 || p[ilen] != ':')
+            continue;
+
+        /* Back over the rate, then the total */
+        while (e > p && (e[-1] == ' ' || e[-1] == '\t'))
+            e--;
+        while (e > p && e[-1] != ' ' && e[-1] != '\t')
+            e--;
+        while (e > p && (e[-1] == ' ' || e[-1] == '\t'))
+            e--;
+        while (e > p && e[-1] >= '0' && e[-1] <= '9')
+            e--;
+        return strtol(e, NULL, 10);
+    }
+
+    return 0;
+}
+
+#ifndef WITHOUT_IRQ
+/* Get IRQ count from the last interrupt table snapshot */
+static long
+get_irq_count(const struct irq_source *src)
+{
+    if (src->index < 0)
+        return get_irq_count_cmd(src->irq);
+
+    if (src->index >= intrtab.nintr)
+        return 0;
+
+    return (long)intrtab.counts[src->index];
+}
+
+#endif
+
+/* Interrupt number from a name like "irq64", -1 if there is none */
+static int
+irq_number(const char *irq)
+{
+    char *end;
+    long num;
+
+    if (strncmp(irq, "irq", 3) != 0)
+        return -1;
+
+    num = strtol(irq + 3, &end, 10);
+    if (end == irq + 3 || num < 0)
+        return -1;
+
+    return (int)num;
+}
+
+/*
+ * Get the CPU an interrupt is bound to, as shown by cpuset -g -x.
+ * Returns -1 when it may run on several CPUs or the binding is unknown.
+ */
+static int
+get_irq_cpu(int num)
+{
+    cpuset_t mask;
+    int cpu = -1;
+
+    if (num < 0)
+        return -1;
+
+    CPU_ZERO(&mask);
+    if (cpuset_getaffinity(CPU_LEVEL_WHICH, CPU_WHICH_IRQ, num,
+                           sizeof(mask), &mask) < 0)
+        return -1;
+
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+        if (!CPU_ISSET(i, &mask))
+            continue;
+        if (cpu >= 0)
+            return -1;
+        cpu = i;
+    }
+
+    return cpu;
+}
+
+/* Count CPUs in kern.cp_times, 0 if it is not available */
+static int
+cp_times_ncpu(void)
+{
+    size_t len = 0;
+
+    if (sysctl_node_get(&oid_cp_times, NULL, &len) < 0)
+        return 0;
+
+    return len / (CPUSTATES * sizeof(long));
+}
+
+/* Get per-CPU tick counters, ncpu * CPUSTATES entries */
+static int
+get_cp_times(long *times, int ncpu)
+{
+    size_t len = (size_t)ncpu * CPUSTATES * sizeof(long);
+
+    if (sysctl_node_get(&oid_cp_times, times, &len) < 0 && errno != ENOMEM)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Get xruns for a device from sndctl output, one pass over lines like
+ * "dsp4.play.0.xruns=3".
+ */
+static int
+get_xruns_cmd(int unit, int play_only, struct channel_xruns *channels, int max_channels)
+{
+    static const char suffix[] = ".xruns";
+    const size_t slen = sizeof(suffix) - 1;
+    char dev[32];
+    char *argv[] = { "sndctl", "-f", dev, "-v", "-o", NULL };
+    const char *pos, *end, *line;
+    size_t len;
+    int count = 0;
+
+    snprintf(dev, sizeof(dev), "/dev/dsp%d", unit);
+    if (exec_cmd(argv, &cmdout) < 0)
+        return 0;
+
+    pos = cmdout.buf;
+    end = cmdout.buf + cmdout.len;
+    while ((line = next_line(&pos, end, &len)) != NULL && count < max_channels) {
+        const char *eq = memchr(line, '=', len);
+        size_t klen;
+
+        if (eq == NULL || (klen = eq - line) <= slen ||
+            memcmp(eq - slen, suffix, slen) != 0)
+            continue;
+        klen -= slen;
+
+        /* Check play_only filter */
+        if (play_only && memmem(line, klen, "play", 4) == NULL)
+            continue;
+
+        /* Convert dsp to pcm */
+        if (klen > 3 && memcmp(line, "dsp", 3) == 0)
+            snprintf(channels[count].name, sizeof(channels[count].name),
+                     "pcm%.*s", (int)(klen - 3), line + 3);
+        else
+            snprintf(channels[count].name, sizeof(channels[count].name),
+                     "%.*s", (int)klen, line);
+
+        channels[count].xruns = (int)strtol(eq + 1, NULL, 10);
+        count++;
+    }
+
+    return count;
+}
+
+/* Fetch and unpack the device list from /dev/sndstat */
+static nvlist_t *
+sndstat_fetch(struct sndstat *st)
+{
+    struct sndstioc_nv_arg arg;
+
+    if (st->fd < 0) {
+        st->fd = open("/dev/sndstat", O_RDONLY | O_CLOEXEC);
+        if (st->fd < 0)
+            return NULL;
+    }
+
+    if (ioctl(st->fd, SNDSTIOC_REFRESH_DEVS, NULL) < 0) {
+        if (errno == ENOTTY || errno == EINVAL)
+            st->no_chan_info = 1;
+        return NULL;
+    }
+
+    for (int tries = 0; tries < 4; tries++) {
+        arg.nbytes = st->buflen;
+        arg.buf = st->buf;
+        if (st->buflen > 0) {
+            if (ioctl(st->fd, SNDSTIOC_GET_DEVS, &arg) < 0)
+                return NULL;
+            /* Zero means the buffer was too small */
+            if (arg.nbytes > 0)
+                return nvlist_unpack(st->buf, arg.nbytes, 0);
+        }
+
+        /* Ask for the required size and grow the buffer */
+        arg.nbytes = 0;
+        arg.buf = NULL;
+        if (ioctl(st->fd, SNDSTIOC_GET_DEVS, &arg) < 0 || arg.nbytes == 0)
+            return NULL;
+
+        void *buf = realloc(st->buf, arg.nbytes * 2);
+        if (buf == NULL)
+            return NULL;
+        st->buf = buf;
+        st->buflen = arg.nbytes * 2;
+    }
+
+    return NULL;
+}
+
+/*
+ * Find the sound(4) channel list of a unit in the sndstat nvlist.
+ * Returns NULL when the unit or its channel info is missing.
+ */
+static const nvlist_t * const *
+find_unit_channels(const nvlist_t *nvl, int unit, size_t *nchans)
+{
+    const nvlist_t * const *dsps;
+    const nvlist_t *pinfo = NULL;
+    size_t ndsps;
+
+    if (!nvlist_exists_nvlist_array(nvl, SNDST_DSPS))
+        return NULL;
+
+    dsps = nvlist_get_nvlist_array(nvl, SNDST_DSPS, &ndsps);
+    for (size_t i = 0; i < ndsps; i++) {
+        const nvlist_t *pi;
+
+        if (!nvlist_exists_string(dsps[i], SNDST_DSPS_PROVIDER) ||
+            strcmp(nvlist_get_string(dsps[i], SNDST_DSPS_PROVIDER),
+                   SNDST_DSPS_SOUND4_PROVIDER) != 0 ||
+            !nvlist_exists_nvlist(dsps[i], SNDST_DSPS_PROVIDER_INFO))
+            continue;
+
+        pi = nvlist_get_nvlist(dsps[i], SNDST_DSPS_PROVIDER_INFO);
+        if (nvlist_exists_number(pi, SNDST_DSPS_SOUND4_UNIT) &&
+            (int)nvlist_get_number(pi, SNDST_DSPS_SOUND4_UNIT) == unit) {
+            pinfo = pi;
+            break;
+        }
+    }
+
+    /* Older kernels don't export per-channel info */
+    if (pinfo == NULL || !nvlist_exists_nvlist_array(pinfo, SNDST_DSPS_SOUND4_CHAN_INFO)) {
+        if (pinfo != NULL)
+            sndst.no_chan_info = 1;
+        return NULL;
+    }
+
+    return nvlist_get_nvlist_array(pinfo, SNDST_DSPS_SOUND4_CHAN_INFO, nchans);
+}
+
+/* Get xruns from sound(4) channel info in the sndstat nvlist */
+static int
+get_xruns_nv(const nvlist_t *nvl, int unit, int play_only,
+             struct channel_xruns *channels, int max_channels)
+{
+    const nvlist_t * const *chans;
+    size_t nchans;
+    int count = 0;
+
+    if ((chans = find_unit_channels(nvl, unit, &nchans)) == NULL)
+        return -1;
+
+    for (size_t i = 0; i < nchans && count < max_channels; i++) {
+        const char *name;
+
+        if (!nvlist_exists_string(chans[i], SNDST_DSPS_SOUND4_CHAN_NAME) ||
+            !nvlist_exists_number(chans[i], SNDST_DSPS_SOUND4_CHAN_XRUNS))
+            continue;
+
+        name = nvlist_get_string(chans[i], SNDST_DSPS_SOUND4_CHAN_NAME);
+        if (play_only && strstr(name, "play") == NULL)
+            continue;
+
+        /* Convert dsp to pcm, as with sndctl output */
+        if (strncmp(name, "dsp", 3) == 0)
+            snprintf(channels[count].name, sizeof(channels[count].name), "pcm%s", name + 3);
+        else
+            snprintf(channels[count].name, sizeof(channels[count].name), "%s", name);
+
+        channels[count].xruns = (int)nvlist_get_number(chans[i], SNDST_DSPS_SOUND4_CHAN_XRUNS);
+        count++;
+    }
+
+    return count;
+}
+
+/*
+ * Get xruns for a device from an nvlist fetched once per tick, or from
+ * sndctl when it is not available (nvl == NULL).
+ */
+static int
+get_xruns(const nvlist_t *nvl, int unit, int play_only,
+          struct channel_xruns *channels, int max_channels)
+{
+    int count = -1;
+
+    if (nvl != NULL)
+        count = get_xruns_nv(nvl, unit, play_only, channels, max_channels);
+
+    if (count < 0)
+        count = get_xruns_cmd(unit, play_only, channels, max_channels);
+
+    return count;
+}
+
+/* Compute the buffer headroom of a channel, -1 if it isn't exported */
+static int
+chan_headroom(const nvlist_t *ch, const char *name, int *size)
+{
+    int play = strstr(name, "play") != NULL;
+    const char *hw = play ? SNDST_DSPS_SOUND4_CHAN_HWBUF_READY : SNDST_DSPS_SOUND4_CHAN_HWBUF_FREE;
+    const char *sw = play ? SNDST_DSPS_SOUND4_CHAN_SWBUF_READY : SNDST_DSPS_SOUND4_CHAN_SWBUF_FREE;
+
+    if (!nvlist_exists_number(ch, SNDST_DSPS_SOUND4_CHAN_HWBUF_SIZE) ||
+        !nvlist_exists_number(ch, SNDST_DSPS_SOUND4_CHAN_SWBUF_SIZE) ||
+        !nvlist_exists_number(ch, hw) || !nvlist_exists_number(ch, sw))
+        return -1;
+
+    *size = (int)(nvlist_get_number(ch, SNDST_DSPS_SOUND4_CHAN_HWBUF_SIZE) +
+                  nvlist_get_number(ch, SNDST_DSPS_SOUND4_CHAN_SWBUF_SIZE));
+    return (int)(nvlist_get_number(ch, hw) + nvlist_get_number(ch, sw));
+}
+
+/*
+ * Fold the buffer levels of a unit into bufs, keeping the lowest
+ * headroom of each channel.  The kernel list only reads channel state,
+ * the device is not opened.  Channels are usually found at the same
+ * position as in the last probe.
+ */
+static void
+probe_buffers(const nvlist_t *nvl, int unit, int play_only,
+              struct buf_fill *bufs, int *nbufs, int max_channels)
+{
+    const nvlist_t * const *chans;
+    size_t nchans;
+    int pos = 0;
+
+    if ((chans = find_unit_channels(nvl, unit, &nchans)) == NULL)
+        return;
+
+    for (size_t i = 0; i < nchans; i++) {
+        const char *name;
+        struct buf_fill *b = NULL;
+        int size, headroom;
+
+        if (!nvlist_exists_string(chans[i], SNDST_DSPS_SOUND4_CHAN_NAME))
+            continue;
+        name = nvlist_get_string(chans[i], SNDST_DSPS_SOUND4_CHAN_NAME);
+        if (play_only && strstr(name, "play") == NULL)
+            continue;
+        if ((headroom = chan_headroom(chans[i], name, &size)) < 0 || size <= 0)
+            continue;
+
+        /* Same dsp to pcm naming as the xrun counters */
+        if (strncmp(name, "dsp", 3) == 0)
+            name += 3;
+        if (pos < *nbufs && strcmp(bufs[pos].name + 3, name) == 0) {
+            b = &bufs[pos];
+        } else {
+            for (int j = 0; j < *nbufs; j++) {
+                if (strcmp(bufs[j].name + 3, name) == 0) {
+                    b = &bufs[j];
+                    break;
+                }
+            }
+        }
+        if (b == NULL) {
+            if (*nbufs == max_channels)
+                continue;
+            b = &bufs[(*nbufs)++];
+            snprintf(b->name, sizeof(b->name), "pcm%s", name);
+            b->probes = 0;
+        }
+        pos = b - bufs + 1;
+
+        b->size = size;
+        b->headroom = headroom;
+        if (b->probes++ == 0 || headroom < b->min_headroom)
+            b->min_headroom = headroom;
+    }
+}
+
+/* Probe buffer levels of all watched devices with one sndstat fetch */
+static void
+probe_all_buffers(struct watch *w, const nvlist_t *nvl)
+{
+    for (int i = 0; i < w->num_mons; i++)
+        probe_buffers(nvl, w->mons[i].unit, w->cfg->play_only,
+                      &w->bufs[i * w->max_channels], &w->num_bufs[i],
+                      w->max_channels);
+}
+
+#ifndef WITHOUT_USB
+/*
+ * Get USB stats from usbconfig dump_stats, one pass over lines like
+ * "  UE_ISOCHRONOUS_FAIL: 8".
+ */
+static int
+get_usb_stats_cmd(const char *ugen, struct usb_stats *stats)
+{
+    char dev[32];
+    char *argv[] = { "usbconfig", "-d", dev, "dump_stats", NULL };
+    const struct {
+        const char *key;
+        size_t len;
+        int *val;
+    } keys[] = {
+        { "UE_CONTROL_FAIL", 15, &stats->ctrl_fail },
+        { "UE_ISOCHRONOUS_FAIL", 19, &stats->iso_fail },
+        { "UE_BULK_FAIL", 12, &stats->bulk_fail },
+        { "UE_INTERRUPT_FAIL", 17, &stats->int_fail },
+    };
+    const char *pos, *end, *line;
+    size_t len;
+
+    memset(stats, 0, sizeof(*stats));
+
+    snprintf(dev, sizeof(dev), "%s", ugen);
+    if (exec_cmd(argv, &cmdout) < 0 || cmdout.len == 0)
+        return -1;
+
+    pos = cmdout.buf;
+    end = cmdout.buf + cmdout.len;
+    while ((line = next_line(&pos, end, &len)) != NULL) {
+        const char *p = line;
+        const char *colon;
+        size_t klen;
+
+        while (len > 0 && (*p == ' ' || *p == '\t')) {
+            p++;
+            len--;
+        }
+        if (len < 4 || p[0] != 'U' || p[1] != 'E' || (colon = memchr(p, ':', len)) == NULL)
+            continue;
+
+        klen = colon - p;
+        for (size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+            if (klen == keys[k].len && memcmp(p, keys[k].key, klen) == 0) {
+                *keys[k].val = (int)strtol(colon + 1, NULL, 10);
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Get USB stats via USB_DEVICESTATS ioctl on /dev/ugenX.Y.  The descriptor
+ * is cached in *fd and reopened on the next call if the device went away.
+ */
+static int
+get_usb_stats(const char *ugen, int *fd, struct usb_stats *stats)
+{
+    struct usb_device_stats st;
+    char path[32];
+
+    if (*fd < 0) {
+        snprintf(path, sizeof(path), "/dev/ugen%s", ugen);
+        *fd = open(path, O_RDWR | O_CLOEXEC);
+        if (*fd < 0) {
+            if (errno == ENOENT || errno == ENXIO)
+                return -1;
+            /* No access to the device node, let usbconfig try */
+            return get_usb_stats_cmd(ugen, stats);
+        }
+    }
+
+    if (ioctl(*fd, USB_DEVICESTATS, &st) < 0) {
+        close(*fd);
+        *fd = -1;
+        return -1;
+    }
+
+    stats->ctrl_fail = st.uds_requests_fail[UE_CONTROL];
+    stats->iso_fail = st.uds_requests_fail[UE_ISOCHRONOUS];
+    stats->bulk_fail = st.uds_requests_fail[UE_BULK];
+    stats->int_fail = st.uds_requests_fail[UE_INTERRUPT];
+
+    return 0;
+}
+
+/* Read vendor, product and serial number of a USB device */
+static int
+usb_ident_read(const char *ugen, struct usb_ident *id)
+{
+    struct usb_device_info di;
+    char path[32];
+    int fd;
+
+    snprintf(path, sizeof(path), "/dev/ugen%s", ugen);
+    if ((fd = open(path, O_RDWR | O_CLOEXEC)) < 0)
+        return -1;
+    if (ioctl(fd, USB_GET_DEVICEINFO, &di) < 0) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    id->vendor = di.udi_vendorNo;
+    id->product = di.udi_productNo;
+    snprintf(id->serial, sizeof(id->serial), "%s", di.udi_serial);
+    id->known = 1;
+    return 0;
+}
+
+/* Same device, a missing serial number only compares equal to another missing one */
+static int
+usb_ident_match(const struct usb_ident *a, const struct usb_ident *b)
+{
+    return a->known && b->known && a->vendor == b->vendor &&
+        a->product == b->product && strcmp(a->serial, b->serial) == 0;
+}
+#endif
+
+/* List available audio devices, see resolve_device() for their topology */
+static int
+list_devices(struct pcm_device **devicesp)
+{
+    struct pcm_device *devices = NULL;
+    FILE *fp;
+    char line[512];
+    int count = 0;
+    int cap = 0;
+    int default_unit = get_default_unit();
+
+    *devicesp = NULL;
+
+    fp = fopen("/dev/sndstat", "r");
+    if (fp == NULL) {
+        perror("Cannot open /dev/sndstat");
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "pcm", 3) != 0)
+            continue;
+
+        if (count == cap) {
+            int ncap = cap > 0 ? cap * 2 : 16;
+            struct pcm_device *d = realloc(devices, ncap * sizeof(*d));
+
+            if (d == NULL)
+                break;
+            devices = d;
+            cap = ncap;
+        }
+
+        struct pcm_device *dev = &devices[count];
+        memset(dev, 0, sizeof(*dev));
+        dev->irq_index = -1;
+
+        /* Parse unit number */
+        dev->unit = atoi(line + 3);
+
+        /* Parse description (after ": ") */
+        char *desc_start = strchr(line, ':');
+        if (desc_start) {
+            desc_start += 2; /* skip ": " */
+            char *newline = strchr(desc_start, '\n');
+            if (newline) *newline = '\0';
+            strncpy(dev->desc, desc_start, sizeof(dev->desc) - 1);
+        }
+
+        /* Check if default */
+        dev->is_default = (dev->unit == default_unit);
+
+        count++;
+    }
+
+    fclose(fp);
+    *devicesp = devices;
+    return count;
+}
+
+#ifndef WITHOUT_USB
+/* Connect to devd(8) for attach/detach notifications */
+static int
+devd_connect(void)
+{
+    struct sockaddr_un sun;
+    int fd;
+
+    fd = socket(PF_LOCAL, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        return -1;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, DEVD_PIPE, sizeof(sun.sun_path) - 1);
+
+    if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Read one devd event and check for USB attach/detach.  Returns 1 for
+ * attach, -1 for detach and 0 otherwise; ugen gets e.g. "0.4" and id
+ * the device identity when the event has it.  Format:
+ * "!system=USB subsystem=DEVICE type=ATTACH ugen=ugen0.4 cdev=ugen0.4
+ *  vendor=0x08bb product=0x2902 ... sernum="..." ..."
+ */
+static int
+devd_read_usb_event(int fd, char *ugen, size_t ugen_len, struct usb_ident *id)
+{
+    char buf[1024];
+    char *p, *q;
+    ssize_t n;
+    int type;
+
+    n = recv(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+
+    if (strncmp(buf, "!system=USB ", 12) != 0 ||
+        strstr(buf, " subsystem=DEVICE ") == NULL)
+        return 0;
+
+    if (strstr(buf, " type=ATTACH") != NULL)
+        type = 1;
+    else if (strstr(buf, " type=DETACH") != NULL)
+        type = -1;
+    else
+        return 0;
+
+    if ((p = strstr(buf, " ugen=ugen")) == NULL)
+        return 0;
+
+    p += 10; /* skip " ugen=ugen" */
+    size_t len = strcspn(p, " \n");
+    if (len >= ugen_len)
+        len = ugen_len - 1;
+    memcpy(ugen, p, len);
+    ugen[len] = '\0';
+
+    memset(id, 0, sizeof(*id));
+    if ((p = strstr(buf, " vendor=")) != NULL && (q = strstr(buf, " product=")) != NULL) {
+        id->vendor = (uint16_t)strtol(p + 8, NULL, 16);
+        id->product = (uint16_t)strtol(q + 9, NULL, 16);
+        id->known = 1;
+        if ((p = strstr(buf, " sernum=\"")) != NULL) {
+            p += 9;
+            snprintf(id->serial, sizeof(id->serial), "%.*s", (int)strcspn(p, "\""), p);
+        }
+    }
+
+    return type;
+}
+#endif
+
+/*
+ * Set up kqueue with the sampling timer, the -b buffer probe timer,
+ * termination signals, SIGINFO and, when available, the devd socket.
+ * Signals are delivered as events, so their default action is disabled.
+ */
+static int
+setup_events(uint64_t period, uint64_t probe_period, int devd_fd)
+{
+    struct kevent ev[6];
+    int n = 0;
+    int kq;
+
+    if ((kq = kqueue()) < 0)
+        return -1;
+
+    EV_SET(&ev[n++], 1, EVFILT_TIMER, EV_ADD, NOTE_NSECONDS, period, NULL);
+    if (probe_period > 0)
+        EV_SET(&ev[n++], 2, EVFILT_TIMER, EV_ADD, NOTE_NSECONDS, probe_period, NULL);
+    EV_SET(&ev[n++], SIGINT, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+    EV_SET(&ev[n++], SIGTERM, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+    EV_SET(&ev[n++], SIGINFO, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+    if (devd_fd >= 0)
+        EV_SET(&ev[n++], devd_fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+
+    if (kevent(kq, ev, n, NULL, 0, NULL) < 0) {
+        close(kq);
+        return -1;
+    }
+
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    signal(SIGINFO, SIG_IGN);
+
+    return kq;
+}
+
+/* Print device list */
+static void
+print_devices(struct pcm_device *devices, int count, int verbose)
+{
+    printf("Available audio devices:\n\n");
+
+    for (int i = 0; i < count; i++) {
+        struct pcm_device *dev = &devices[i];
+        
+        printf("  pcm%d", dev->unit);
+        
+        if (dev->is_default)
+            printf(" (default)");
+        
+        resolve_device(dev, verbose);
+        if (dev->is_usb && verbose && dev->controller[0] != '\0')
+            printf(" [usb:%s %s %s]", dev->ugen, dev->controller,
+                   dev->irq[0] != '\0' ? dev->irq : "no irq");
+        else if (dev->is_usb)
+            printf(" [usb:%s]", dev->ugen);
+        
+        printf(": %s\n", dev->desc);
+    }
+
+    printf("\n");
+}
+
+/* Parse -d argument: "all" or a comma-separated list of units */
+static int
+parse_units(const char *arg, struct config *cfg)
+{
+    const char *p = arg;
+    char *end;
+
+    if (strcmp(arg, "all") == 0) {
+        cfg->all_units = 1;
+        return 0;
+    }
+
+    cfg->num_units = 0;
+    for (;;) {
+        long unit = strtol(p, &end, 10);
+        int *units;
+
+        if (end == p || unit < 0)
+            return -1;
+        if ((units = realloc(cfg->units, (cfg->num_units + 1) * sizeof(*units))) == NULL)
+            return -1;
+        cfg->units = units;
+        cfg->units[cfg->num_units++] = (int)unit;
+
+        if (*end == '\0')
+            return 0;
+        if (*end != ',')
+            return -1;
+        p = end + 1;
+    }
+}
+
+/* Parse a -S sweep like "hw.snd.latency=1,2,3" */
+static int
+parse_sweep(const char *arg, struct sweep_param *sp)
+{
+    const char *eq = strchr(arg, '=');
+    const char *p;
+    char *end;
+
+    if (eq == NULL || eq == arg || (size_t)(eq - arg) >= sizeof(sp->name))
+        return -1;
+
+    memset(sp, 0, sizeof(*sp));
+    memcpy(sp->name, arg, eq - arg);
+    for (p = eq + 1; ; p = end + 1) {
+        long val = strtol(p, &end, 10);
+
+        if (end == p || val < 0 || val > INT32_MAX || sp->nvalues == SWEEP_VALUES)
+            return -1;
+        sp->values[sp->nvalues++] = (int)val;
+        if (*end == '\0')
+            break;
+        if (*end != ',')
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Parse a -s list like "cpu,mem,usb" or "all", 0 if invalid */
+static int
+parse_stress(const char *arg)
+{
+    char buf[64];
+    char *tok, *save;
+    int kinds = 0;
+
+    snprintf(buf, sizeof(buf), "%s", arg);
+    for (tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        if (strcmp(tok, "cpu") == 0)
+            kinds |= STRESS_CPU;
+        else if (strcmp(tok, "mem") == 0)
+            kinds |= STRESS_MEM;
+        else if (strcmp(tok, "usb") == 0)
+            kinds |= STRESS_USB;
+        else if (strcmp(tok, "all") == 0)
+            kinds |= STRESS_CPU | STRESS_MEM | STRESS_USB;
+        else
+            return 0;
+    }
+
+    return kinds;
+}
+
+/* Print usage */
+static void
+usage(const char *progname)
+{
+    printf("usage: %s [-d device[,device...]|all] [-p] [-xruns] [-usb] [-w] [-i interval] [-t threshold]\n"
+           "       [-z zscore] [-T] [-cpu N] [-rtprio N] [-R file [-Rsize MB]] [-r file]\n"
+           "       [-c window] [-m host:port] [-o text|json|csv] [-v] [-B count]\n"
+           "       [-I N] [-C] [-b ms] [-D] [-q] [-s cpu,mem,usb [-sstep sec]]\n"
+           "       [-S sysctl=v1,v2,... [-soak sec]]\n\n", progname);
+    printf("Options:\n");
+    printf("  -d N      Monitor device pcmN (default: system default)\n");
+    printf("            Several units (-d 4,6,7) or all devices (-d all) can be\n");
+    printf("            monitored in one process\n");
+    printf("  -p        Show only playback channels\n");
+    printf("  -xruns    Show only xruns (no USB errors, no IRQ monitoring)\n");
+    printf("  -usb      Show only USB errors and IRQ monitoring (no xruns)\n");
+    printf("  -w        Watch mode - start monitoring\n");
+    printf("  -i SEC    Interval in seconds, fractional allowed (default: 1)\n");
+    printf("  -t N      IRQ spike threshold multiplier (default: 1.5)\n");
+    printf("  -z N      Minimum IRQ spike z-score over the baseline (default: 3)\n");
+    printf("  -T        Sample in a separate thread, output never delays sampling\n");
+    printf("  -cpu N    Pin sampler thread to CPU N (implies -T)\n");
+    printf("  -rtprio N Run sampler thread with realtime priority N (implies -T)\n");
+    printf("  -R FILE   Record every raw sample to a circular binary trace\n");
+    printf("  -Rsize MB Size of the trace file (default: %d)\n", TRACE_DEFAULT_MB);
+    printf("  -r FILE   Replay a recorded trace (use -t to try other thresholds)\n");
+    printf("  -c SEC    Group IRQ spikes, USB errors and xruns within SEC seconds\n");
+    printf("            into one incident line with their order and lag\n");
+    printf("  -m ADDR   Serve OpenMetrics on http://ADDR/metrics (e.g. :9101)\n");
+    printf("  -o FMT    Event output: text (default), json (JSON Lines) or csv\n");
+    printf("  -v        List USB controllers and interrupts of the devices\n");
+    printf("  -B N      Benchmark: call each collector N times and show its cost\n");
+    printf("  -A N      Benchmark: run N synthetic samples (or -r trace samples)\n");
+    printf("            through the detection and check what it finds\n");
+    printf("  -I N      Scan all interrupts, report sources spiking with xruns and\n");
+    printf("            the N busiest on SIGINFO and at exit\n");
+    printf("  -C        Show the CPU and its load for controller interrupts\n");
+    printf("            in ticks with xruns or IRQ spikes\n");
+    printf("  -b MS     Probe channel buffer levels every MS milliseconds and\n");
+    printf("            report headroom below %d%%\n", BUF_LOW_PCT);
+    printf("  -D        Daemon: watch in the background and publish metrics in\n");
+    printf("            shared memory %s\n", SHM_NAME);
+    printf("  -q        Print the metrics published by a running daemon\n");
+    printf("  -s LIST   Ramp up cpu, mem and/or usb load (or all) in %d steps and\n",
+           STRESS_LEVELS);
+    printf("            report the level where xruns and ISO failures start\n");
+    printf("  -sstep S  Seconds per stress level (default: %d)\n", STRESS_STEP_DEFAULT);
+    printf("  -S N=V,.. Step sysctl N through the values, e.g. hw.snd.latency=1,2,3\n");
+    printf("            (up to %d, as all combinations), and show xrun and ISO\n",
+           SWEEP_PARAMS);
+    printf("            failure rates for each\n");
+    printf("  -soak S   Seconds per sweep setting (default: %d)\n", SWEEP_SOAK_DEFAULT);
+    printf("  -h        Show this help\n\n");
+    printf("Notes:\n");
+    printf("  Without -w, shows available devices and exits.\n");
+    printf("  IRQ monitoring is enabled when USB monitoring is active.\n");
+    printf("  The IRQ baseline keeps adapting, a spike must exceed both -t and -z.\n");
+    printf("  Use -usb to monitor only USB errors and IRQ spikes.\n");
+    printf("  Use -xruns to monitor only audio buffer xruns (no IRQ).\n");
+    printf("  Wakeup latency of the sampler is shown on SIGINFO (^T) and at exit.\n\n");
+    printf("Examples:\n");
+    printf("  %s              List available audio devices\n", progname);
+    printf("  %s -w           Monitor default device\n", progname);
+    printf("  %s -d 1 -w      Monitor pcm1\n", progname);
+    printf("  %s -d all -w    Monitor all devices\n", progname);
+    printf("  %s -d 0 -p -w   Monitor only playback xruns on pcm0\n", progname);
+    printf("  %s -xruns -w    Monitor only xruns\n", progname);
+    printf("  %s -usb -w      Monitor only USB errors and IRQ\n", progname);
+    printf("  %s -t 2.0 -w    Set IRQ spike threshold to 2x baseline\n", progname);
+    printf("  %s -i 0.05 -w   Sample every 50 ms\n", progname);
+    printf("  %s -R /var/tmp/snd.trace -w\n", progname);
+    printf("                 Record a trace for later analysis\n");
+    printf("  %s -r /var/tmp/snd.trace -t 1.2\n", progname);
+    printf("                 Re-analyse it with a lower IRQ threshold\n");
+}
+
+/* Channel slots of monitor i in a sample */
+static struct channel_xruns *
+sample_channels(const struct watch *w, const struct sample *smp, int i)
+{
+    return smp->channels + (size_t)i * w->max_channels;
+}
+
+/* Give a sample room for every watched source, memory comes from the arena */
+static int
+sample_init(struct watch *w, struct sample *smp)
+{
+    int n = w->num_mons;
+
+    memset(smp, 0, sizeof(*smp));
+    smp->num_channels = arena_alloc(&w->arena, n * sizeof(*smp->num_channels));
+    smp->channels = arena_alloc(&w->arena,
+                                (size_t)n * w->max_channels * sizeof(*smp->channels));
+    smp->usb_ok = arena_alloc(&w->arena, n * sizeof(*smp->usb_ok));
+    smp->usb = arena_alloc(&w->arena, n * sizeof(*smp->usb));
+    smp->irq = arena_alloc(&w->arena, n * sizeof(*smp->irq));
+    if (w->scan != NULL)
+        smp->intr = arena_alloc(&w->arena, w->scan->n * sizeof(*smp->intr));
+    if (w->ncpu > 0) {
+        smp->irq_cpu = arena_alloc(&w->arena, n * sizeof(*smp->irq_cpu));
+        smp->cp_times = arena_alloc(&w->arena,
+                                    (size_t)w->ncpu * CPUSTATES * sizeof(*smp->cp_times));
+    }
+    if (w->bufs != NULL) {
+        smp->num_bufs = arena_alloc(&w->arena, n * sizeof(*smp->num_bufs));
+        smp->bufs = arena_alloc(&w->arena,
+                                (size_t)n * w->max_channels * sizeof(*smp->bufs));
+    }
+
+    if (smp->num_channels == NULL || smp->channels == NULL ||
+        smp->usb_ok == NULL || smp->usb == NULL || smp->irq == NULL ||
+        (w->scan != NULL && smp->intr == NULL) ||
+        (w->ncpu > 0 && (smp->irq_cpu == NULL || smp->cp_times == NULL)) ||
+        (w->bufs != NULL && (smp->num_bufs == NULL || smp->bufs == NULL)))
+        return -1;
+    return 0;
+}
+
+/* Fetch channel info for all devices, NULL when only sndctl works */
+static nvlist_t *
+fetch_channels(void)
+{
+    if (sndst.no_chan_info)
+        return NULL;
+
+    return sndstat_fetch(&sndst);
+}
+
+#ifndef WITHOUT_USB
+/*
+ * Native stats need read/write access to the ugen node, which devfs
+ * rules may grant a device on one address and not on another.  Opens
+ * and caches the descriptor, returns 1 if the ioctl backend can be used.
+ */
+static int
+usb_probe_native(struct usb_source *u)
+{
+    char path[32];
+
+    if (u->fd < 0) {
+        snprintf(path, sizeof(path), "/dev/ugen%s", u->node);
+        u->fd = open(path, O_RDWR | O_CLOEXEC);
+    }
+    return u->native = u->fd >= 0;
+}
+
+/* Read USB counters of a source with the backend found for its node */
+static int
+read_usb_stats(struct usb_source *u, struct usb_stats *stats)
+{
+    if (!u->native)
+        return get_usb_stats_cmd(u->node, stats);
+
+    return get_usb_stats(u->node, &u->fd, stats);
+}
+
+/*
+ * Find the pcm unit of a monitor again after its USB device came back,
+ * uaudio may attach a little after the device itself.  Without
+ * libdevinfo the old unit is kept.
+ */
+static void
+monitor_rebind(struct watch *w, struct monitor *m)
+{
+    const struct usb_source *u = &w->usbs[m->usb];
+    uint64_t now = mono_ns();
+    int nth = 0;
+    int unit;
+
+    if (u->detached || now < m->rebind)
+        return;
+
+    /* Units on one device keep their order */
+    for (const struct monitor *o = w->mons; o < m; o++) {
+        if (o->usb == m->usb)
+            nth++;
+    }
+
+    topology_invalidate(&topo);
+    if (topology_load(&topo) < 0) {
+        m->rebind = 0;
+        return;
+    }
+    if ((unit = topology_find_pcm(&topo, u->node, nth)) < 0) {
+        m->rebind = now + USB_RESCAN_NS;
+        return;
+    }
+    atomic_store_explicit(&m->unit, unit, memory_order_relaxed);
+    m->rebind = 0;
+}
+#endif
+
+/* Sample xrun counters, and buffer levels from the same sndstat fetch */
+static void
+collect_xruns(struct watch *w, struct sample *smp)
+{
+    nvlist_t *nvl = w->xruns_be.kind == BACKEND_NATIVE ? fetch_channels() : NULL;
+
+    for (int i = 0; i < w->num_mons; i++) {
+#ifndef WITHOUT_USB
+        if (w->mons[i].rebind != 0)
+            monitor_rebind(w, &w->mons[i]);
+#endif
+        smp->num_channels[i] = get_xruns(nvl, w->mons[i].unit,
+                                         w->cfg->play_only,
+                                         sample_channels(w, smp, i),
+                                         w->max_channels);
+    }
+    if (nvl != NULL && w->bufs != NULL)
+        probe_all_buffers(w, nvl);
+    if (nvl != NULL)
+        nvlist_destroy(nvl);
+
+    /* Hand the lowest levels since the last tick over, start again */
+    if (w->bufs != NULL) {
+        for (int i = 0; i < w->num_mons; i++) {
+            struct buf_fill *b = &w->bufs[i * w->max_channels];
+            int n = 0;
+
+            /* Channels not seen since the last tick are gone */
+            for (int j = 0; j < w->num_bufs[i]; j++) {
+                if (b[j].probes > 0)
+                    b[n++] = b[j];
+            }
+            w->num_bufs[i] = n;
+            memcpy(&smp->bufs[i * w->max_channels], b, n * sizeof(*b));
+            smp->num_bufs[i] = n;
+            for (int j = 0; j < n; j++)
+                b[j].probes = 0;
+        }
+    }
+}
+
+#ifndef WITHOUT_USB
+/* Sample transfer failures of every USB device */
+static void
+collect_usb(struct watch *w, struct sample *smp)
+{
+    for (int i = 0; i < w->num_usb; i++) {
+        struct usb_source *u = &w->usbs[i];
+
+        if (u->detached) {
+            smp->usb_ok[i] = -1;
+            continue;
+        }
+        smp->usb_ok[i] = read_usb_stats(u, &smp->usb[i]) == 0;
+
+        /* No devd to tell when it is back, usb_rescan() looks for it */
+        if (!smp->usb_ok[i] && w->devd_fd < 0 && u->id.known) {
+            u->detached = 1;
+            u->rescan = smp->ts + USB_RESCAN_NS;
+        }
+    }
+}
+#endif
+
+#ifndef WITHOUT_IRQ
+/* Sample controller interrupts from the tick's interrupt table snapshot */
+static void
+collect_irq(struct watch *w, struct sample *smp)
+{
+    for (int i = 0; i < w->num_irq; i++)
+        smp->irq[i] = get_irq_count(&w->irqs[i]);
+
+    if (w->scan != NULL) {
+        int n = intrtab.nintr < w->scan->n ? intrtab.nintr : w->scan->n;
+
+        memcpy(smp->intr, intrtab.counts, n * sizeof(*smp->intr));
+    }
+}
+#endif
+
+/*
+ * Read every sysctl of the tick back to back, right at its timestamp and
+ * into buffers allocated at startup: the interrupt counters (one array
+ * for all controllers and -I) and the -C CPU times.
+ */
+static void
+sysctl_snapshot(struct watch *w, struct sample *smp)
+{
+    if (HAVE_IRQ && (w->irq_be.kind == BACKEND_NATIVE || w->scan != NULL))
+        intr_table_refresh(&intrtab);
+
+    if (w->ncpu > 0 && get_cp_times(smp->cp_times, w->ncpu) < 0)
+        memcpy(smp->cp_times, w->prev_cp_times,
+               (size_t)w->ncpu * CPUSTATES * sizeof(*smp->cp_times));
+}
+
+/* Take one sample of every counter being watched */
+static void
+take_sample(struct watch *w, struct sample *smp)
+{
+    smp->type = SAMPLE_TICK;
+    smp->ts = mono_ns();
+    smp->late = -1;
+    clock_gettime(CLOCK_REALTIME, &smp->wall);
+    sysctl_snapshot(w, smp);
+
+    for (int i = 0; i < w->num_active; i++)
+        w->active[i]->sample(w, smp);
+
+    /* Bindings can be changed with cpuset at any time */
+    if (w->ncpu > 0) {
+        for (int i = 0; i < w->num_irq; i++)
+            smp->irq_cpu[i] = get_irq_cpu(w->irqs[i].num);
+    }
+}
+
+#ifndef WITHOUT_USB
+/*
+ * Switch a USB source to the address its device is on now and fill smp
+ * with the attach.  Counters, baselines and history stay with the
+ * source and its monitors, which look up their pcm units again.
+ */
+static void
+usb_reattach(struct watch *w, int i, const char *ugen, struct sample *smp)
+{
+    struct usb_source *u = &w->usbs[i];
+
+    if (u->fd >= 0) {
+        close(u->fd);
+        u->fd = -1;
+    }
+    snprintf(u->node, sizeof(u->node), "%s", ugen);
+    u->detached = 0;
+    /* The new node may be readable where the old one wasn't, or not */
+    usb_probe_native(u);
+
+    for (int j = 0; j < w->num_mons; j++) {
+        if (w->mons[j].usb == i)
+            w->mons[j].rebind = 1;
+    }
+
+    smp->type = SAMPLE_ATTACH;
+    smp->source = i;
+    smp->ts = mono_ns();
+    smp->late = -1;
+    clock_gettime(CLOCK_REALTIME, &smp->wall);
+    snprintf(smp->ugen, sizeof(smp->ugen), "%s", ugen);
+
+    /* Counters restart with the device */
+    smp->usb_ok[i] = read_usb_stats(u, &smp->usb[i]) == 0;
+}
+
+/*
+ * Handle a devd event for one of the watched USB devices.  Returns 1 and
+ * fills smp when there is something to report.  A device is recognised
+ * by vendor, product and serial number when both sides have them, so it
+ * is found again on a new address.
+ */
+static int
+take_usb_event(struct watch *w, struct sample *smp)
+{
+    struct usb_ident id;
+    char ugen[16];
+    int type = devd_read_usb_event(w->devd_fd, ugen, sizeof(ugen), &id);
+
+    if (type == 0)
+        return 0;
+
+    /* Device tree changed, the next lookup takes a new snapshot */
+    topology_invalidate(&topo);
+
+    for (int i = 0; i < w->num_usb; i++) {
+        struct usb_source *u = &w->usbs[i];
+        int same = strcmp(ugen, u->node) == 0;
+
+        if (type > 0) {
+            if (id.known && u->id.known ? !usb_ident_match(&id, &u->id) : !same)
+                continue;
+            /* A twin of a device still in use isn't it */
+            if (!u->detached && !same)
+                continue;
+            usb_reattach(w, i, ugen, smp);
+            return 1;
+        }
+
+        if (!same)
+            continue;
+
+        if (u->fd >= 0) {
+            close(u->fd);
+            u->fd = -1;
+        }
+        u->detached = 1;
+        smp->type = SAMPLE_DETACH;
+        smp->source = i;
+        smp->ts = mono_ns();
+        smp->late = -1;
+        clock_gettime(CLOCK_REALTIME, &smp->wall);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Without devd, look through /dev once a second for watched devices that
+ * stopped responding, wherever they come back.  Returns 1 and fills smp
+ * for a device found again.
+ */
+static int
+usb_rescan(struct watch *w, struct sample *smp)
+{
+    uint64_t now = mono_ns();
+
+    for (int i = 0; i < w->num_usb; i++) {
+        struct usb_source *u = &w->usbs[i];
+        struct dirent *de;
+        DIR *dir;
+
+        if (!u->detached || now < u->rescan)
+            continue;
+        u->rescan = now + USB_RESCAN_NS;
+
+        if ((dir = opendir("/dev")) == NULL)
+            continue;
+        while ((de = readdir(dir)) != NULL) {
+            struct usb_ident id = { 0 };
+            const char *node = de->d_name + 4;
+            int busy = 0;
+
+            if (strncmp(de->d_name, "ugen", 4) != 0)
+                continue;
+            for (int j = 0; j < w->num_usb; j++) {
+                if (!w->usbs[j].detached && strcmp(w->usbs[j].node, node) == 0)
+                    busy = 1;
+            }
+            if (busy || usb_ident_read(node, &id) < 0 || !usb_ident_match(&id, &u->id))
+                continue;
+
+            closedir(dir);
+            usb_reattach(w, i, node, smp);
+            return 1;
+        }
+        closedir(dir);
+    }
+
+    return 0;
+}
+#endif
+
+/* Histogram bucket for a value */
+static int
+lat_bucket(uint64_t v)
+{
+    int msb, shift;
+
+    if (v < (1 << LAT_SUB_BITS))
+        return (int)v;
+
+    msb = 63 - __builtin_clzll(v);
+    shift = msb - LAT_SUB_BITS;
+    return ((shift + 1) << LAT_SUB_BITS) + (int)((v >> shift) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+/* Highest value that falls into a bucket */
+static uint64_t
+lat_bucket_max(int idx)
+{
+    int shift, sub;
+
+    if (idx < (1 << LAT_SUB_BITS))
+        return idx;
+
+    shift = (idx >> LAT_SUB_BITS) - 1;
+    sub = idx & ((1 << LAT_SUB_BITS) - 1);
+    return ((((uint64_t)1 << LAT_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+/* Record one wakeup lateness, in ns */
+static void
+lat_record(struct latency_hist *h, int64_t late_ns)
+{
+    uint64_t us = late_ns / 1000;
+
+    h->buckets[lat_bucket(us)]++;
+    h->count++;
+    h->sum += us;
+    if (us > h->max)
+        h->max = us;
+}
+
+/* Value below which the given fraction of samples fall */
+static uint64_t
+lat_percentile(const struct latency_hist *h, double frac)
+{
+    uint64_t want = (uint64_t)ceil(h->count * frac);
+    uint64_t seen = 0;
+
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= want && seen > 0)
+            return lat_bucket_max(i) < h->max ? lat_bucket_max(i) : h->max;
+    }
+
+    return h->max;
+}
+
+/* Write a string as a JSON or CSV field */
+static void
+emit_string(int format, const char *str)
+{
+    if (format == OUTPUT_CSV && strpbrk(str, ",\"\n") == NULL) {
+        fputs(str, stdout);
+        return;
+    }
+
+    putchar('"');
+    for (const char *p = str; *p != '\0'; p++) {
+        if (*p == '"')
+            fputs(format == OUTPUT_JSON ? "\\\"" : "\"\"", stdout);
+        else if (format == OUTPUT_JSON && *p == '\\')
+            fputs("\\\\", stdout);
+        else if (format == OUTPUT_JSON && (unsigned char)*p < 0x20)
+            printf("\\u%04x", *p);
+        else
+            putchar(*p);
+    }
+    putchar('"');
+}
+
+/*
+ * Emit one event record in the -o format.  mono is CLOCK_MONOTONIC in
+ * nanoseconds for ordering, wall the matching UTC time.  Unused numeric
+ * fields are passed as NAN, an unused detail as NULL.
+ */
+static void
+emit_record(struct watch *w, uint64_t mono, const struct timespec *wall,
+            const char *event, const char *source, double from, double to,
+            double score, const char *detail)
+{
+    int format = w->cfg->output;
+    const double nums[3] = { from, to, score };
+    static const char *names[3] = { "from", "to", "score" };
+    char wallbuf[48];
+    struct tm tm;
+
+    gmtime_r(&wall->tv_sec, &tm);
+    strftime(wallbuf, sizeof(wallbuf), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(wallbuf + strlen(wallbuf), sizeof(wallbuf) - strlen(wallbuf),
+             ".%09ldZ", (long)wall->tv_nsec);
+
+    if (format == OUTPUT_JSON) {
+        printf("{\"mono_ns\":%ju,\"wall\":\"%s\",\"event\":\"%s\",\"source\":",
+               (uintmax_t)mono, wallbuf, event);
+        emit_string(format, source);
+        for (int i = 0; i < 3; i++) {
+            if (!isnan(nums[i]))
+                printf(",\"%s\":%.15g", names[i], nums[i]);
+        }
+        if (detail != NULL) {
+            fputs(",\"detail\":", stdout);
+            emit_string(format, detail);
+        }
+        fputs("}\n", stdout);
+        return;
+    }
+
+    printf("%ju,%s,%s,", (uintmax_t)mono, wallbuf, event);
+    emit_string(format, source);
+    for (int i = 0; i < 3; i++) {
+        putchar(',');
+        if (!isnan(nums[i]))
+            printf("%.15g", nums[i]);
+    }
+    putchar(',');
+    if (detail != NULL)
+        emit_string(format, detail);
+    putchar('\n');
+}
+
+/* Emit a record for an event found in a sample */
+static void
+emit_sample(struct watch *w, const struct sample *smp, const char *event,
+            const char *source, double from, double to, double score)
+{
+    emit_record(w, smp->ts, &smp->wall, event, source, from, to, score, NULL);
+}
+
+/* Print wakeup lateness statistics of the sampler */
+static void
+print_latency(struct watch *w, const struct latency_hist *h)
+{
+    if (h->count == 0)
+        return;
+
+    if (w->cfg->output != OUTPUT_TEXT) {
+        struct timespec wall;
+        char detail[128];
+
+        clock_gettime(CLOCK_REALTIME, &wall);
+        snprintf(detail, sizeof(detail), "n=%ju avg=%juus p50=%juus p99=%juus p99.9=%juus max=%juus",
+                 (uintmax_t)h->count, (uintmax_t)(h->sum / h->count),
+                 (uintmax_t)lat_percentile(h, 0.5), (uintmax_t)lat_percentile(h, 0.99),
+                 (uintmax_t)lat_percentile(h, 0.999), (uintmax_t)h->max);
+        emit_record(w, mono_ns(), &wall, "latency", "sampler", NAN,
+                    NAN, NAN, detail);
+        return;
+    }
+
+    printf("Wakeup latency: n=%ju avg=%juus p50=%juus p99=%juus p99.9=%juus max=%juus\n",
+           (uintmax_t)h->count, (uintmax_t)(h->sum / h->count),
+           (uintmax_t)lat_percentile(h, 0.5), (uintmax_t)lat_percentile(h, 0.99),
+           (uintmax_t)lat_percentile(h, 0.999), (uintmax_t)h->max);
+}
+
+/* Print the open incident as one line and close it */
+static void
+incident_flush(struct watch *w)
+{
+    struct incident *inc = &w->incident;
+    int order[EVSRC_COUNT];
+    int n = 0;
+    char timestamp[16];
+    char chain[EVSRC_COUNT * 96];
+    size_t len = 0;
+    const char *verdict;
+
+    chain[0] = '\0';
+    if (!inc->open)
+        return;
+    inc->open = 0;
+
+    /* Sources that fired, by time of their first event */
+    for (int src = 0; src < EVSRC_COUNT; src++) {
+        if (inc->count[src] == 0)
+            continue;
+        int j = n++;
+        while (j > 0 && inc->first[order[j - 1]] > inc->first[src]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = src;
+    }
+
+    /* A lone IRQ spike or USB error is already on its own line */
+    if (inc->count[EVSRC_XRUN] == 0 && n < 2)
+        return;
+
+    if (inc->count[EVSRC_XRUN] == 0)
+        verdict = "no xruns";
+    else if (inc->count[EVSRC_USB] > 0 && inc->first[EVSRC_USB] <= inc->first[EVSRC_XRUN])
+        verdict = "USB-bus-driven";
+    else if (inc->count[EVSRC_IRQ] > 0 && inc->first[EVSRC_IRQ] <= inc->first[EVSRC_XRUN])
+        verdict = "CPU-driven (interrupt load)";
+    else
+        verdict = "CPU-driven";
+
+    for (int k = 0; k < n; k++) {
+        int src = order[k];
+
+        len += snprintf(chain + len, sizeof(chain) - len, "%s%s",
+                        k > 0 ? " -> " : "", inc->desc[src]);
+        if (inc->count[src] > 1 && len < sizeof(chain))
+            len += snprintf(chain + len, sizeof(chain) - len, " x%d", inc->count[src]);
+        if (k > 0 && len < sizeof(chain))
+            len += snprintf(chain + len, sizeof(chain) - len, " (+%.2fs)",
+                            (double)(inc->first[src] - inc->start) / NSEC_PER_SEC);
+        if (len >= sizeof(chain))
+            len = sizeof(chain) - 1;
+    }
+
+    if (w->cfg->output != OUTPUT_TEXT) {
+        emit_record(w, inc->start, &inc->wall, "incident", verdict,
+                    NAN, NAN, NAN, chain);
+        return;
+    }
+
+    format_timestamp(timestamp, sizeof(timestamp), &inc->wall, w->msec);
+    printf("[%s] Incident: %s, %s\n", timestamp, chain, verdict);
+}
+
+/* Close the incident once its window has passed */
+static void
+incident_expire(struct watch *w)
+{
+    uint64_t window = (uint64_t)(w->cfg->corr_window * NSEC_PER_SEC);
+
+    if (w->incident.open && w->now - w->incident.start > window)
+        incident_flush(w);
+}
+
+/* Add an event from one source to the current incident */
+static void
+incident_event(struct watch *w, const struct timespec *wall, int src,
+               const char *fmt, ...)
+{
+    struct incident *inc = &w->incident;
+    va_list ap;
+
+    if (w->cfg->corr_window <= 0)
+        return;
+
+    incident_expire(w);
+
+    if (!inc->open) {
+        memset(inc, 0, sizeof(*inc));
+        inc->open = 1;
+        inc->start = w->now;
+        inc->wall = *wall;
+    }
+
+    if (inc->count[src]++ == 0) {
+        inc->first[src] = w->now;
+        va_start(ap, fmt);
+        vsnprintf(inc->desc[src], sizeof(inc->desc[src]), fmt, ap);
+        va_end(ap);
+    }
+}
+
+/* Allocate a channel table for up to cap distinct channel names */
+static int
+chan_table_init(struct chan_table *t, struct arena *a, int cap, int max_channels)
+{
+    int hsize = 1;
+
+    while (hsize < 2 * cap)
+        hsize <<= 1;
+
+    memset(t, 0, sizeof(*t));
+    t->cap = cap;
+    t->hash_mask = hsize - 1;
+    t->names = arena_alloc(a, cap * sizeof(*t->names));
+    t->xruns = arena_alloc(a, cap * sizeof(*t->xruns));
+    t->seen = arena_alloc(a, cap * sizeof(*t->seen));
+    t->hash = arena_alloc(a, hsize * sizeof(*t->hash));
+    t->order = arena_alloc(a, max_channels * sizeof(*t->order));
+    t->spare_names = arena_alloc(a, max_channels * sizeof(*t->spare_names));
+    t->spare_xruns = arena_alloc(a, max_channels * sizeof(*t->spare_xruns));
+
+    if (t->names == NULL || t->xruns == NULL || t->seen == NULL ||
+        t->hash == NULL || t->order == NULL ||
+        t->spare_names == NULL || t->spare_xruns == NULL)
+        return -1;
+    return 0;
+}
+
+/* FNV-1a */
+static uint32_t
+chan_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+
+    while (*name != '\0')
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h;
+}
+
+/* Empty hash bucket for a name known not to be in the table */
+static uint32_t
+chan_free_bucket(const struct chan_table *t, const char *name)
+{
+    uint32_t h;
+
+    for (h = chan_hash(name) & t->hash_mask; t->hash[h] != 0; h = (h + 1) & t->hash_mask)
+        ;
+    return h;
+}
+
+/*
+ * Drop channels that weren't present at the last tick, after many
+ * channels came and went.  Values of the present ones are kept.
+ */
+static void
+chan_table_compact(struct chan_table *t)
+{
+    int n = t->num_order;
+
+    for (int i = 0; i < n; i++) {
+        memcpy(t->spare_names[i], t->names[t->order[i]], sizeof(t->names[0]));
+        t->spare_xruns[i] = t->xruns[t->order[i]];
+    }
+
+    memset(t->hash, 0, (t->hash_mask + 1) * sizeof(*t->hash));
+    for (int i = 0; i < n; i++) {
+        memcpy(t->names[i], t->spare_names[i], sizeof(t->names[0]));
+        t->xruns[i] = t->spare_xruns[i];
+        t->seen[i] = t->tick;
+        t->order[i] = i;
+        t->hash[chan_free_bucket(t, t->names[i])] = i + 1;
+    }
+    t->num = n;
+}
+
+/* Slot of the channel at position pos of the current tick */
+static int
+chan_slot(struct chan_table *t, int pos, const char *name)
+{
+    uint32_t h;
+    int slot;
+
+    if (pos < t->num_order && strcmp(t->names[t->order[pos]], name) == 0)
+        return t->order[pos];
+
+    for (h = chan_hash(name) & t->hash_mask; t->hash[h] != 0; h = (h + 1) & t->hash_mask) {
+        if (strcmp(t->names[t->hash[h] - 1], name) == 0)
+            return t->hash[h] - 1;
+    }
+
+    /* chan_update() made sure there is room */
+    slot = t->num++;
+    snprintf(t->names[slot], sizeof(t->names[slot]), "%s", name);
+    t->xruns[slot] = 0;
+    t->seen[slot] = 0;
+    t->hash[h] = slot + 1;
+    return slot;
+}
+
+/*
+ * Fold the channels of a tick into the table.  prev gets the value each
+ * channel had at the previous tick, 0 if it wasn't present then.
+ */
+static void
+chan_update(struct chan_table *t, const struct channel_xruns *channels, int n,
+            int *prev)
+{
+    uint64_t tick;
+
+    if (t->num + n > t->cap)
+        chan_table_compact(t);
+    tick = ++t->tick;
+
+    for (int i = 0; i < n; i++) {
+        int slot = chan_slot(t, i, channels[i].name);
+
+        if (prev != NULL)
+            prev[i] = t->seen[slot] == tick - 1 ? t->xruns[slot] : 0;
+        t->xruns[slot] = channels[i].xruns;
+        t->seen[slot] = tick;
+        t->order[i] = slot;
+    }
+    t->num_order = n;
+}
+
+/* Print xruns changes for one device */
+static void
+check_xruns(struct watch *w, struct monitor *m, const struct sample *smp,
+            const struct channel_xruns *channels, int num_channels,
+            const char *timestamp)
+{
+    int *prev = w->prev_xruns;
+
+    chan_update(&m->chans, channels, num_channels, prev);
+
+    for (int i = 0; i < num_channels; i++) {
+        int prev_val = prev[i];
+
+        if (channels[i].xruns == 0)
+            continue;
+
+        if (channels[i].xruns != prev_val) {
+            /* Lower than before, the channel was set up again and counts from 0 */
+            int reset = channels[i].xruns < prev_val;
+            int diff = reset ? channels[i].xruns : channels[i].xruns - prev_val;
+
+            if (w->cfg->output != OUTPUT_TEXT)
+                emit_sample(w, smp, reset ? "xruns_reset" : "xruns", channels[i].name,
+                            prev_val, channels[i].xruns, diff);
+            else
+                printf("[%s] %s xruns: %d -> %d (%s+%d)\n",
+                       timestamp, channels[i].name,
+                       prev_val, channels[i].xruns, reset ? "reset, " : "", diff);
+            incident_event(w, &smp->wall, EVSRC_XRUN, "%s xruns +%d",
+                           channels[i].name, diff);
+            w->xrun_tick = 1;
+            w->roll.tick[ROLL_XRUNS] += diff;
+            if (reset)
+                w->resets++;
+        }
+    }
+}
+
+#ifndef WITHOUT_USB
+/* Print USB error changes for one USB device */
+static void
+check_usb(struct watch *w, struct usb_source *u, const struct sample *smp,
+          int ok, const struct usb_stats *usb, const char *timestamp)
+{
+    if (!ok) {
+        /* Said once, the gap is reported when the device is back */
+        if (u->down)
+            return;
+        u->down = 1;
+        u->down_ts = smp->ts;
+        if (w->cfg->output != OUTPUT_TEXT)
+            emit_sample(w, smp, "usb_not_responding", u->ugen, NAN, NAN, NAN);
+        else
+            printf("[%s] USB WARNING: %sDevice disconnected or not responding\n",
+                   timestamp, u->label);
+        return;
+    }
+
+    if (u->down) {
+        double gap = (double)(smp->ts - u->down_ts) / NSEC_PER_SEC;
+
+        u->down = 0;
+        if (w->cfg->output != OUTPUT_TEXT)
+            emit_sample(w, smp, "usb_responding", u->ugen, NAN, NAN, gap);
+        else
+            printf("[%s] USB: %sresponding again after %.1f s\n",
+                   timestamp, u->label, gap);
+        /* Counters may have restarted, take them as the new baseline */
+        u->prev = *usb;
+        return;
+    }
+
+    /* Counters restart from zero when the device is reset, as on attach */
+    if (usb->ctrl_fail < u->prev.ctrl_fail || usb->iso_fail < u->prev.iso_fail ||
+        usb->bulk_fail < u->prev.bulk_fail || usb->int_fail < u->prev.int_fail) {
+        u->prev = *usb;
+        return;
+    }
+
+    if (usb->iso_fail > u->prev.iso_fail)
+        w->roll.tick[ROLL_USB_ISO] += usb->iso_fail - u->prev.iso_fail;
+    if (usb->ctrl_fail > u->prev.ctrl_fail)
+        w->roll.tick[ROLL_USB_OTHER] += usb->ctrl_fail - u->prev.ctrl_fail;
+    if (usb->bulk_fail > u->prev.bulk_fail)
+        w->roll.tick[ROLL_USB_OTHER] += usb->bulk_fail - u->prev.bulk_fail;
+    if (usb->int_fail > u->prev.int_fail)
+        w->roll.tick[ROLL_USB_OTHER] += usb->int_fail - u->prev.int_fail;
+
+    if (usb->ctrl_fail != u->prev.ctrl_fail) {
+        int diff = usb->ctrl_fail - u->prev.ctrl_fail;
+        if (w->cfg->output != OUTPUT_TEXT)
+            emit_sample(w, smp, "usb_control_fail", u->ugen, u->prev.ctrl_fail, usb->ctrl_fail, NAN);
+        else
+            printf("[%s] %sUE_CONTROL_FAIL: %d -> %d (+%d)\n",
+                   timestamp, u->label, u->prev.ctrl_fail, usb->ctrl_fail, diff);
+        incident_event(w, &smp->wall, EVSRC_USB, "%sUE_CONTROL_FAIL +%d", u->label, diff);
+        u->prev.ctrl_fail = usb->ctrl_fail;
+    }
+
+    if (usb->iso_fail != u->prev.iso_fail) {
+        int diff = usb->iso_fail - u->prev.iso_fail;
+        if (w->cfg->output != OUTPUT_TEXT)
+            emit_sample(w, smp, "usb_isochronous_fail", u->ugen, u->prev.iso_fail, usb->iso_fail, NAN);
+        else
+            printf("[%s] %sUE_ISOCHRONOUS_FAIL: %d -> %d (+%d)\n",
+                   timestamp, u->label, u->prev.iso_fail, usb->iso_fail, diff);
+        incident_event(w, &smp->wall, EVSRC_USB, "%sUE_ISOCHRONOUS_FAIL +%d", u->label, diff);
+        u->prev.iso_fail = usb->iso_fail;
+    }
+
+    if (usb->bulk_fail != u->prev.bulk_fail) {
+        int diff = usb->bulk_fail - u->prev.bulk_fail;
+        if (w->cfg->output != OUTPUT_TEXT)
+            emit_sample(w, smp, "usb_bulk_fail", u->ugen, u->prev.bulk_fail, usb->bulk_fail, NAN);
+        else
+            printf("[%s] %sUE_BULK_FAIL: %d -> %d (+%d)\n",
+                   timestamp, u->label, u->prev.bulk_fail, usb->bulk_fail, diff);
+        incident_event(w, &smp->wall, EVSRC_USB, "%sUE_BULK_FAIL +%d", u->label, diff);
+        u->prev.bulk_fail = usb->bulk_fail;
+    }
+
+    if (usb->int_fail != u->prev.int_fail) {
+        int diff = usb->int_fail - u->prev.int_fail;
+        if (w->cfg->output != OUTPUT_TEXT)
+            emit_sample(w, smp, "usb_interrupt_fail", u->ugen, u->prev.int_fail, usb->int_fail, NAN);
+        else
+            printf("[%s] %sUE_INTERRUPT_FAIL: %d -> %d (+%d)\n",
+                   timestamp, u->label, u->prev.int_fail, usb->int_fail, diff);
+        incident_event(w, &smp->wall, EVSRC_USB, "%sUE_INTERRUPT_FAIL +%d", u->label, diff);
+        u->prev.int_fail = usb->int_fail;
+    }
+}
+
+#endif
+
+#ifndef WITHOUT_IRQ
+/*
+ * Fold one rate sample into the streaming baseline.  The first samples
+ * are averaged evenly, after that an EWMA with a time constant of
+ * IRQ_BASELINE_TAU takes over, so the baseline follows workload changes
+ * and recovers from a spike during startup.
+ */
+static void
+irq_baseline_update(struct irq_source *q, double rate, double elapsed, double weight)
+{
+    double alpha = 1.0 - exp(-elapsed / IRQ_BASELINE_TAU);
+    double diff, incr;
+
+    if (q->samples < IRQ_CALIBRATION_SAMPLES && alpha < 1.0 / q->samples)
+        alpha = 1.0 / q->samples;
+    alpha *= weight;
+
+    diff = rate - q->mean;
+    incr = alpha * diff;
+    q->mean += incr;
+    q->var = (1.0 - alpha) * (q->var + diff * incr);
+}
+
+/* Check interrupt rate of one controller for spikes */
+static void
+check_irq(struct watch *w, struct irq_source *q, const struct sample *smp,
+          long curr_irq_count, double elapsed, const char *timestamp)
+{
+    u_long delta;
+
+    q->spiked = 0;
+
+    /* 0 is a failed read, the next rate is taken over both ticks */
+    if (curr_irq_count == 0) {
+        q->gap += elapsed;
+        return;
+    }
+    elapsed += q->gap;
+    q->gap = 0;
+
+    /*
+     * The unsigned difference is right across a wraparound of 32-bit
+     * counters, anything over half the range is a counter that went back:
+     * the interrupt was set up again.  Counting restarts from there.
+     */
+    delta = (u_long)curr_irq_count - (u_long)q->prev_count;
+    if (q->prev_count == 0 || delta > ULONG_MAX / 2) {
+        if (q->prev_count != 0)
+            w->resets++;
+        q->prev_count = curr_irq_count;
+        return;
+    }
+    q->prev_count = curr_irq_count;
+
+    /* Rate per second over the measured, not nominal, interval */
+    long irq_rate = (long)(delta / elapsed);
+
+    w->roll.tick[ROLL_IRQ] += delta;
+    q->rate = irq_rate;
+
+    /* Calibrate over first N samples */
+    if (q->samples < IRQ_CALIBRATION_SAMPLES) {
+        q->samples++;
+        irq_baseline_update(q, irq_rate, elapsed, 1.0);
+
+        if (q->samples == IRQ_CALIBRATION_SAMPLES) {
+            if (w->cfg->output != OUTPUT_TEXT)
+                emit_sample(w, smp, "irq_baseline", q->controller, NAN,
+                            q->mean, sqrt(q->var));
+            else
+                printf("[%s] %s baseline: %ld/s (sd %.0f)\n",
+                       timestamp, q->controller, (long)q->mean, sqrt(q->var));
+        }
+        return;
+    }
+
+    /* Check for spike, sd no lower than Poisson noise of the count */
+    double sd = sqrt(q->var);
+    double sd_min = sqrt(q->mean / elapsed);
+    double z = (irq_rate - q->mean) / (sd > sd_min ? sd : (sd_min > 1.0 ? sd_min : 1.0));
+    int spike = q->mean > 0 && irq_rate > q->mean * w->cfg->irq_threshold &&
+                z >= w->cfg->irq_zscore;
+
+    q->spiked = spike;
+    if (spike) {
+        float ratio = irq_rate / q->mean;
+        q->spikes++;
+        w->roll.tick_spikes++;
+        if (w->cfg->output != OUTPUT_TEXT)
+            emit_sample(w, smp, "irq_spike", q->controller, q->mean, irq_rate, z);
+        else
+            printf("[%s] %s: %ld -> %ld/s (%.1fx, z=%.1f)\n",
+                   timestamp, q->controller,
+                   (long)q->mean, irq_rate, ratio, z);
+        incident_event(w, &smp->wall, EVSRC_IRQ, "%s IRQ %.1fx",
+                       q->controller, ratio);
+    }
+
+    /* Spikes move the baseline only slowly, a lasting change gets absorbed */
+    irq_baseline_update(q, irq_rate, elapsed, spike ? IRQ_SPIKE_WEIGHT : 1.0);
+}
+
+#endif
+
+/*
+ * Report buffer headroom of a tick.  Text output only shows channels
+ * that came close to an xrun, JSON and CSV get every channel.
+ */
+static void
+check_buffers(struct watch *w, const struct sample *smp, const char *timestamp)
+{
+    for (int i = 0; i < w->num_mons; i++) {
+        const struct buf_fill *b = &smp->bufs[i * w->max_channels];
+        struct buf_fill *worst = &w->buf_worst[i * w->max_channels];
+
+        for (int j = 0; j < smp->num_bufs[i]; j++) {
+            double pct = 100.0 * b[j].min_headroom / b[j].size;
+            int k;
+
+            if (w->cfg->output != OUTPUT_TEXT)
+                emit_sample(w, smp, "buffer_headroom", b[j].name, b[j].size,
+                            b[j].min_headroom, pct);
+            else if (pct < BUF_LOW_PCT)
+                printf("[%s] %s buffer headroom low: %.0f%% (%d/%d bytes, %d probes)\n",
+                       timestamp, b[j].name, pct, b[j].min_headroom, b[j].size,
+                       b[j].probes);
+
+            /* Lowest since the start, for the summary */
+            for (k = 0; k < w->num_worst[i]; k++) {
+                if (strcmp(worst[k].name, b[j].name) == 0)
+                    break;
+            }
+            if (k == w->num_worst[i]) {
+                if (k == w->max_channels)
+                    continue;
+                worst[w->num_worst[i]++] = b[j];
+            } else if ((double)b[j].min_headroom / b[j].size <
+                       (double)worst[k].min_headroom / worst[k].size) {
+                worst[k] = b[j];
+            }
+        }
+    }
+}
+
+/* Print the lowest buffer headroom of each channel since the start */
+static void
+print_buffers(struct watch *w)
+{
+    struct timespec wall;
+    int header = 0;
+
+    if (w->buf_worst == NULL)
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &wall);
+    for (int i = 0; i < w->num_mons; i++) {
+        const struct buf_fill *b = &w->buf_worst[i * w->max_channels];
+
+        for (int j = 0; j < w->num_worst[i]; j++) {
+            double pct = 100.0 * b[j].min_headroom / b[j].size;
+
+            if (w->cfg->output != OUTPUT_TEXT) {
+                emit_record(w, mono_ns(), &wall, "buffer_worst", b[j].name,
+                            b[j].size, b[j].min_headroom, pct, NULL);
+                continue;
+            }
+            if (!header++)
+                printf("Lowest buffer headroom:\n");
+            printf("  %-24s %3.0f%% (%d/%d bytes)\n", b[j].name, pct,
+                   b[j].min_headroom, b[j].size);
+        }
+    }
+}
+
+/* Turn the cp_times delta of this tick into per-CPU load */
+static void
+cpu_update(struct watch *w, const struct sample *smp)
+{
+    for (int c = 0; c < w->ncpu; c++) {
+        const long *now = &smp->cp_times[c * CPUSTATES];
+        long *prev = &w->prev_cp_times[c * CPUSTATES];
+        long d[CPUSTATES];
+        long total = 0;
+
+        for (int s = 0; s < CPUSTATES; s++) {
+            d[s] = now[s] - prev[s];
+            total += d[s];
+            prev[s] = now[s];
+        }
+
+        w->cpu_busy[c] = total > 0 ? 100.0 * (total - d[CP_IDLE]) / total : 0;
+        w->cpu_intr[c] = total > 0 ? 100.0 * d[CP_INTR] / total : 0;
+    }
+}
+
+/* Busiest CPU of the last tick */
+static int
+cpu_busiest(const struct watch *w)
+{
+    int best = 0;
+
+    for (int c = 1; c < w->ncpu; c++) {
+        if (w->cpu_busy[c] > w->cpu_busy[best])
+            best = c;
+    }
+
+    return best;
+}
+
+/*
+ * Say which core handled each controller interrupt in a tick with an
+ * xrun or IRQ spike, and how loaded it was.  An unbound interrupt may
+ * run anywhere, so the busiest core is named instead.
+ */
+static void
+cpu_report(struct watch *w, const struct sample *smp, const char *timestamp)
+{
+    /* Without a known controller only the load can be shown */
+    if (w->num_irq == 0 && w->xrun_tick) {
+        int cpu = cpu_busiest(w);
+        char source[16];
+
+        snprintf(source, sizeof(source), "cpu%d", cpu);
+        if (w->cfg->output != OUTPUT_TEXT)
+            emit_sample(w, smp, "cpu_load", source, w->cpu_intr[cpu],
+                        w->cpu_busy[cpu], NAN);
+        else
+            printf("[%s] Busiest CPU %d: %.0f%% busy, %.0f%% interrupt\n",
+                   timestamp, cpu, w->cpu_busy[cpu], w->cpu_intr[cpu]);
+    }
+
+    for (int i = 0; i < w->num_irq; i++) {
+        const struct irq_source *q = &w->irqs[i];
+        int cpu = q->cpu >= 0 && q->cpu < w->ncpu ? q->cpu : cpu_busiest(w);
+        const char *shared = cpu == w->cfg->sampler_cpu ? ", sampler CPU" : "";
+        char source[16];
+
+        if (!w->xrun_tick && !q->spiked)
+            continue;
+
+        if (w->cfg->output != OUTPUT_TEXT) {
+            snprintf(source, sizeof(source), "cpu%d", cpu);
+            emit_record(w, smp->ts, &smp->wall, "cpu_load", source,
+                        w->cpu_intr[cpu], w->cpu_busy[cpu], NAN, q->irq);
+            continue;
+        }
+
+        if (q->cpu >= 0)
+            printf("[%s] %s (%s) on CPU %d: %.0f%% busy, %.0f%% interrupt%s\n",
+                   timestamp, q->irq, q->controller, cpu,
+                   w->cpu_busy[cpu], w->cpu_intr[cpu], shared);
+        else
+            printf("[%s] %s (%s) unbound, busiest CPU %d: %.0f%% busy, "
+                   "%.0f%% interrupt%s\n", timestamp, q->irq, q->controller,
+                   cpu, w->cpu_busy[cpu], w->cpu_intr[cpu], shared);
+    }
+}
+
+/* Report interrupts moved to another CPU since the last tick */
+static void
+check_irq_cpu(struct watch *w, const struct sample *smp, const char *timestamp)
+{
+    for (int i = 0; i < w->num_irq; i++) {
+        struct irq_source *q = &w->irqs[i];
+        int cpu = smp->irq_cpu[i];
+
+        if (cpu == q->cpu)
+            continue;
+
+        if (w->cfg->output != OUTPUT_TEXT)
+            emit_sample(w, smp, "irq_cpu", q->irq, q->cpu, cpu, NAN);
+        else if (cpu >= 0)
+            printf("[%s] %s (%s) now bound to CPU %d\n",
+                   timestamp, q->irq, q->controller, cpu);
+        else
+            printf("[%s] %s (%s) now unbound\n", timestamp, q->irq, q->controller);
+        q->cpu = cpu;
+    }
+}
+
+/* Set up the interrupt scan from the current interrupt table */
+static struct intr_scan *
+intr_scan_init(struct arena *a)
+{
+    struct intr_scan *sc;
+    const char *name, *end;
+    int n;
+
+    if (intrtab.names == NULL && intr_table_load(&intrtab) < 0)
+        return NULL;
+    n = intrtab.nintr;
+
+    if ((sc = arena_alloc(a, sizeof(*sc))) == NULL)
+        return NULL;
+    sc->n = n;
+    sc->names = arena_alloc(a, n * sizeof(*sc->names));
+    sc->prev = arena_alloc(a, n * sizeof(*sc->prev));
+    sc->rate = arena_alloc(a, n * sizeof(*sc->rate));
+    sc->mean = arena_alloc(a, n * sizeof(*sc->mean));
+    sc->var = arena_alloc(a, n * sizeof(*sc->var));
+    sc->z = arena_alloc(a, n * sizeof(*sc->z));
+    sc->peak = arena_alloc(a, n * sizeof(*sc->peak));
+    sc->total = arena_alloc(a, n * sizeof(*sc->total));
+    sc->spiked = arena_alloc(a, n * sizeof(*sc->spiked));
+    sc->valid = arena_alloc(a, n * sizeof(*sc->valid));
+    if (sc->names == NULL || sc->prev == NULL || sc->rate == NULL ||
+        sc->mean == NULL || sc->var == NULL || sc->z == NULL ||
+        sc->peak == NULL || sc->total == NULL || sc->spiked == NULL ||
+        sc->valid == NULL)
+        return NULL;
+
+    /* Names are padded with spaces, unused slots are empty */
+    name = intrtab.names;
+    end = intrtab.names + intrtab.names_len;
+    for (int i = 0; i < n; i++) {
+        size_t len = name < end ? strnlen(name, end - name) : 0;
+        size_t tlen = len;
+
+        while (tlen > 0 && name[tlen - 1] == ' ')
+            tlen--;
+        if ((sc->names[i] = arena_alloc(a, tlen + 1)) == NULL)
+            return NULL;
+        memcpy(sc->names[i], name, tlen);
+        name += len + 1;
+    }
+
+    return sc;
+}
+
+/*
+ * Fold one snapshot of all interrupt counters into the scan.  Returns
+ * how many sources spiked, by the same rule as check_irq().
+ */
+static int
+intr_scan_update(struct watch *w, const u_long *counts, double elapsed)
+{
+    struct intr_scan *sc = w->scan;
+    const double threshold = w->cfg->irq_threshold;
+    const double zmin = w->cfg->irq_zscore;
+    const double inv = 1.0 / elapsed;
+    const int calibrated = sc->samples >= IRQ_CALIBRATION_SAMPLES;
+    double alpha = 1.0 - exp(-elapsed / IRQ_BASELINE_TAU);
+    int spikes = 0;
+
+    sc->tick++;
+    sc->samples++;
+    sc->elapsed += elapsed;
+    if (!calibrated && alpha < 1.0 / sc->samples)
+        alpha = 1.0 / sc->samples;
+
+    /*
+     * Rates and spike scores, no branches.  As in check_irq(), a delta
+     * over half the range is a counter that went back: prev is resynced
+     * and the source sits the tick out, its baseline untouched.
+     */
+    for (int i = 0; i < sc->n; i++) {
+        u_long delta = counts[i] - sc->prev[i];
+        double valid = delta <= ULONG_MAX / 2;
+        double r = (double)(valid != 0.0 ? delta : 0) * inv;
+        double sd = sqrt(sc->var[i]);
+        double sd_min = sqrt(sc->mean[i] * inv);
+        double div = sd > sd_min ? sd : sd_min;
+
+        sc->rate[i] = valid != 0.0 ? r : sc->mean[i];
+        sc->z[i] = valid * (r - sc->mean[i]) / (div > 1.0 ? div : 1.0);
+        sc->total[i] += valid != 0.0 ? delta : 0;
+        sc->peak[i] = r > sc->peak[i] ? r : sc->peak[i];
+        sc->prev[i] = counts[i];
+        sc->valid[i] = valid;
+    }
+
+    /* Baselines, spikes move them only slowly */
+    for (int i = 0; i < sc->n; i++) {
+        int spike = calibrated && sc->valid[i] != 0.0 && sc->mean[i] > 0 &&
+                    sc->rate[i] > sc->mean[i] * threshold && sc->z[i] >= zmin;
+        double a = (spike ? alpha * IRQ_SPIKE_WEIGHT : alpha) * sc->valid[i];
+        double diff = sc->rate[i] - sc->mean[i];
+        double incr = a * diff;
+
+        sc->mean[i] += incr;
+        sc->var[i] = (1.0 - a) * (sc->var[i] + diff * incr);
+        if (spike) {
+            sc->spiked[i] = sc->tick;
+            spikes++;
+        }
+    }
+
+    return spikes;
+}
+
+/* Report interrupt sources that spiked in this or the previous tick */
+static void
+intr_scan_report(struct watch *w, const struct sample *smp, const char *timestamp)
+{
+    const struct intr_scan *sc = w->scan;
+    int n = 0;
+
+    for (int i = 0; i < sc->n; i++) {
+        if (sc->spiked[i] == 0 || sc->spiked[i] + 1 < sc->tick)
+            continue;
+
+        if (w->cfg->output != OUTPUT_TEXT) {
+            emit_sample(w, smp, "irq_concurrent", sc->names[i], sc->mean[i],
+                        sc->rate[i], sc->z[i]);
+            continue;
+        }
+        if (n++ == 0)
+            printf("[%s] IRQ sources spiking with xruns:", timestamp);
+        printf("%s %s %.0f/s (%.1fx)", n > 1 ? "," : "", sc->names[i],
+               sc->rate[i], sc->rate[i] / sc->mean[i]);
+    }
+
+    if (n > 0)
+        printf("\n");
+}
+
+/* Print the busiest interrupt sources since the start */
+static void
+print_intr_top(struct watch *w)
+{
+    const struct intr_scan *sc = w->scan;
+    int top[64];
+    int ntop = w->cfg->irq_top < 64 ? w->cfg->irq_top : 64;
+    int n = 0;
+
+    if (sc == NULL || sc->elapsed <= 0)
+        return;
+
+    /* Selection of the N largest totals, N is small */
+    for (int i = 0; i < sc->n; i++) {
+        int j;
+
+        if (sc->total[i] == 0 || sc->names[i][0] == '\0')
+            continue;
+        if (n == ntop && sc->total[i] <= sc->total[top[n - 1]])
+            continue;
+        if (n < ntop)
+            n++;
+        for (j = n - 1; j > 0 && sc->total[top[j - 1]] < sc->total[i]; j--)
+            top[j] = top[j - 1];
+        top[j] = i;
+    }
+
+    if (w->cfg->output != OUTPUT_TEXT) {
+        struct timespec wall;
+
+        clock_gettime(CLOCK_REALTIME, &wall);
+        for (int k = 0; k < n; k++) {
+            int i = top[k];
+
+            emit_record(w, mono_ns(), &wall, "irq_top", sc->names[i],
+                        sc->total[i] / sc->elapsed, sc->peak[i], NAN, NULL);
+        }
+        return;
+    }
+
+    printf("Top interrupt sources (avg/s, peak/s):\n");
+    for (int k = 0; k < n; k++) {
+        int i = top[k];
+
+        printf("  %-24s %10.0f %10.0f\n", sc->names[i],
+               sc->total[i] / sc->elapsed, sc->peak[i]);
+    }
+}
+
+/* Sleep until an absolute CLOCK_MONOTONIC time in ns */
+static void
+sleep_until(uint64_t deadline)
+{
+    struct timespec ts = {
+        .tv_sec = deadline / NSEC_PER_SEC,
+        .tv_nsec = deadline % NSEC_PER_SEC
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/* Stress worker: spin for the busy part of each period */
+static void *
+stress_cpu(void *arg)
+{
+    struct stress *st = arg;
+    volatile unsigned x = 1;
+
+    while (!atomic_load_explicit(&st->stop, memory_order_relaxed)) {
+        uint64_t start = mono_ns();
+        uint64_t busy = STRESS_PERIOD_NS *
+                        atomic_load_explicit(&st->level, memory_order_relaxed) / STRESS_LEVELS;
+
+        while (mono_ns() - start < busy)
+            x = x * 1103515245 + 12345;
+        sleep_until(start + STRESS_PERIOD_NS);
+    }
+
+    return NULL;
+}
+
+/* Stress worker: copy a buffer larger than the caches around */
+static void *
+stress_mem(void *arg)
+{
+    struct stress *st = arg;
+    const size_t half = (size_t)STRESS_MEM_MB * 1024 * 1024 / 2;
+    const size_t chunk = 1024 * 1024;
+    char *buf = malloc(2 * half);
+    size_t off = 0;
+
+    if (buf == NULL)
+        return NULL;
+    memset(buf, 1, 2 * half);
+
+    while (!atomic_load_explicit(&st->stop, memory_order_relaxed)) {
+        uint64_t start = mono_ns();
+        uint64_t busy = STRESS_PERIOD_NS *
+                        atomic_load_explicit(&st->level, memory_order_relaxed) / STRESS_LEVELS;
+
+        while (mono_ns() - start < busy) {
+            memcpy(buf + off, buf + half + off, chunk);
+            off = (off + chunk) % half;
+        }
+        sleep_until(start + STRESS_PERIOD_NS);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+#ifndef WITHOUT_USB
+/*
+ * Stress worker: GET_STATUS control requests to the watched device, so
+ * the bus and controller carry extra transfers next to the audio ones.
+ */
+static void *
+stress_usb(void *arg)
+{
+    struct stress *st = arg;
+    struct usb_ctl_request req;
+    uint16_t status;
+    char path[32];
+    int fd;
+
+    snprintf(path, sizeof(path), "/dev/ugen%s", st->ugen);
+    if ((fd = open(path, O_RDWR | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "Warning: cannot open %s for USB stress: %s\n",
+                path, strerror(errno));
+        return NULL;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.ucr_data = &status;
+    req.ucr_request.bmRequestType = UT_READ_DEVICE;
+    req.ucr_request.bRequest = UR_GET_STATUS;
+    USETW(req.ucr_request.wLength, sizeof(status));
+
+    while (!atomic_load_explicit(&st->stop, memory_order_relaxed)) {
+        uint64_t start = mono_ns();
+        int n = atomic_load_explicit(&st->level, memory_order_relaxed) *
+                STRESS_USB_RATE * STRESS_PERIOD_NS / NSEC_PER_SEC;
+
+        for (int i = 0; i < n; i++) {
+            if (ioctl(fd, USB_DO_REQUEST, &req) < 0)
+                break;
+        }
+        sleep_until(start + STRESS_PERIOD_NS);
+    }
+
+    close(fd);
+    return NULL;
+}
+#endif
+
+/* Start the workers at level 0, the first step measures the baseline */
+static struct stress *
+stress_start(struct watch *w)
+{
+    struct stress *st;
+    int n;
+
+    if ((st = arena_alloc(&w->arena, sizeof(*st))) == NULL)
+        return NULL;
+    st->kinds = w->cfg->stress;
+    st->ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (st->ncpu < 1)
+        st->ncpu = 1;
+    st->step_ns = (uint64_t)(w->cfg->stress_step * NSEC_PER_SEC);
+    st->step_start = mono_ns();
+    st->xrun_level = -1;
+    st->iso_level = -1;
+
+    /* USB load goes to the first watched USB device */
+#ifndef WITHOUT_USB
+    if ((st->kinds & STRESS_USB) && w->num_usb > 0)
+        snprintf(st->ugen, sizeof(st->ugen), "%s", w->usbs[0].ugen);
+    else
+#endif
+        st->kinds &= ~STRESS_USB;
+
+    const struct {
+        int kind;
+        int count;
+        void *(*fn)(void *);
+    } workers[] = {
+        { STRESS_CPU, st->ncpu, stress_cpu },
+        { STRESS_MEM, STRESS_MEM_THREADS, stress_mem },
+#ifndef WITHOUT_USB
+        { STRESS_USB, 1, stress_usb },
+#endif
+    };
+
+    n = 0;
+    for (size_t k = 0; k < sizeof(workers) / sizeof(workers[0]); k++) {
+        if (st->kinds & workers[k].kind)
+            n += workers[k].count;
+    }
+    if ((st->threads = arena_alloc(&w->arena, n * sizeof(*st->threads))) == NULL)
+        return NULL;
+
+    for (size_t k = 0; k < sizeof(workers) / sizeof(workers[0]); k++) {
+        if (!(st->kinds & workers[k].kind))
+            continue;
+        for (int i = 0; i < workers[k].count; i++) {
+            if ((errno = pthread_create(&st->threads[st->nthreads], NULL,
+                                        workers[k].fn, st)) != 0) {
+                perror("Cannot start stress thread");
+                return st;
+            }
+            st->nthreads++;
+        }
+    }
+
+    return st;
+}
+
+/* Stop and join the workers */
+static void
+stress_stop(struct stress *st)
+{
+    atomic_store_explicit(&st->stop, 1, memory_order_relaxed);
+    for (int i = 0; i < st->nthreads; i++)
+        pthread_join(st->threads[i], NULL);
+    st->nthreads = 0;
+}
+
+/* Describe a stress level of the running kinds */
+static void
+stress_describe(const struct stress *st, int level, char *buf, size_t len)
+{
+    int pct = level * 100 / STRESS_LEVELS;
+    size_t n = snprintf(buf, len, "level %d/%d", level, STRESS_LEVELS);
+
+    if ((st->kinds & STRESS_CPU) && n < len)
+        n += snprintf(buf + n, len - n, ", %d CPU threads at %d%%", st->ncpu, pct);
+    if ((st->kinds & STRESS_MEM) && n < len)
+        n += snprintf(buf + n, len - n, ", %d memory threads at %d%%",
+                      STRESS_MEM_THREADS, pct);
+    if ((st->kinds & STRESS_USB) && n < len)
+        snprintf(buf + n, len - n, ", %d USB requests/s", level * STRESS_USB_RATE);
+}
+
+/* Print at which levels xruns and ISO failures first appeared */
+static void
+stress_summary(struct watch *w)
+{
+    const struct stress *st = w->stress;
+    char xdesc[192], idesc[192];
+
+    if (w->cfg->output != OUTPUT_TEXT) {
+        struct timespec wall;
+
+        clock_gettime(CLOCK_REALTIME, &wall);
+        emit_record(w, mono_ns(), &wall, "stress_result", "xruns", NAN,
+                    st->xrun_level, NAN, NULL);
+        emit_record(w, mono_ns(), &wall, "stress_result", "usb_iso_fail", NAN,
+                    st->iso_level, NAN, NULL);
+        return;
+    }
+
+    if (st->xrun_level >= 0)
+        stress_describe(st, st->xrun_level, xdesc, sizeof(xdesc));
+    if (st->iso_level >= 0)
+        stress_describe(st, st->iso_level, idesc, sizeof(idesc));
+
+    printf("Stress result:\n");
+    printf("  xruns:        %s\n", st->xrun_level >= 0 ? xdesc : "none");
+    printf("  ISO failures: %s\n", st->iso_level >= 0 ? idesc : "none");
+}
+
+/*
+ * Per tick: note the level at which xruns and ISO failures first show
+ * up, and move to the next level once a step is over.  After the last
+ * level the workers stop and so does monitoring.
+ */
+static void
+stress_tick(struct watch *w, const struct sample *smp, const char *timestamp)
+{
+    struct stress *st = w->stress;
+    int level = atomic_load_explicit(&st->level, memory_order_relaxed);
+    char desc[192];
+
+    if (st->nthreads == 0)
+        return;
+
+    if (st->xrun_level < 0 && w->roll.tick[ROLL_XRUNS] > 0)
+        st->xrun_level = level;
+    if (st->iso_level < 0 && w->roll.tick[ROLL_USB_ISO] > 0)
+        st->iso_level = level;
+
+    if (smp->ts - st->step_start < st->step_ns)
+        return;
+    st->step_start = smp->ts;
+
+    if (level == STRESS_LEVELS) {
+        stress_stop(st);
+        stress_summary(w);
+        running = 0;
+        return;
+    }
+
+    level++;
+    atomic_store_explicit(&st->level, level, memory_order_relaxed);
+    if (w->cfg->output != OUTPUT_TEXT) {
+        emit_sample(w, smp, "stress_level", "stress", level - 1, level, NAN);
+    } else {
+        stress_describe(st, level, desc, sizeof(desc));
+        printf("[%s] Stress %s\n", timestamp, desc);
+    }
+}
+
+/* Value of sweep parameter p in a step, the last parameter varies fastest */
+static int
+sweep_value(const struct sweep *sw, int step, int p)
+{
+    for (int q = sw->nparams - 1; q > p; q--)
+        step /= sw->params[q].nvalues;
+
+    return sw->params[p].values[step % sw->params[p].nvalues];
+}
+
+/* Describe the settings of a step, e.g. "hw.snd.latency=2 hw.usb.uaudio.buffer_ms=4" */
+static void
+sweep_describe(const struct sweep *sw, int step, char *buf, size_t len)
+{
+    size_t n = 0;
+
+    buf[0] = '\0';
+    for (int p = 0; p < sw->nparams && n < len; p++)
+        n += snprintf(buf + n, len - n, "%s%s=%d", p > 0 ? " " : "",
+                      sw->params[p].name, sweep_value(sw, step, p));
+}
+
+/* Apply the settings of a step, -1 if a sysctl can't be changed */
+static int
+sweep_apply(struct sweep *sw, int step)
+{
+    for (int p = 0; p < sw->nparams; p++) {
+        const struct sweep_param *sp = &sw->params[p];
+
+        if (sysctl_set_int(sp->name, sweep_value(sw, step, p)) < 0) {
+            fprintf(stderr, "Error: cannot set %s: %s\n", sp->name, strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Put every swept sysctl back to its value before the sweep */
+static void
+sweep_restore(struct sweep *sw)
+{
+    if (!sw->active)
+        return;
+
+    for (int p = 0; p < sw->nparams; p++) {
+        if (sysctl_set_int(sw->params[p].name, sw->params[p].orig) < 0)
+            fprintf(stderr, "Warning: cannot restore %s=%d: %s\n",
+                    sw->params[p].name, sw->params[p].orig, strerror(errno));
+    }
+    sw->active = 0;
+}
+
+/* Remember the current values and apply the first step */
+static struct sweep *
+sweep_start(struct watch *w)
+{
+    struct config *cfg = w->cfg;
+    struct sweep *sw;
+
+    if ((sw = arena_alloc(&w->arena, sizeof(*sw))) == NULL)
+        return NULL;
+    sw->params = cfg->sweep;
+    sw->nparams = cfg->nsweep;
+    sw->soak_ns = (uint64_t)(cfg->soak * NSEC_PER_SEC);
+    sw->nsteps = 1;
+
+    for (int p = 0; p < sw->nparams; p++) {
+        struct sweep_param *sp = &sw->params[p];
+
+        if ((sp->orig = sysctl_get_int(sp->name)) < 0) {
+            fprintf(stderr, "Error: cannot read %s\n", sp->name);
+            return NULL;
+        }
+        sw->nsteps *= sp->nvalues;
+    }
+
+    if ((sw->rows = arena_alloc(&w->arena, sw->nsteps * sizeof(*sw->rows))) == NULL)
+        return NULL;
+
+    sw->active = 1;
+    if (sweep_apply(sw, 0) < 0) {
+        sweep_restore(sw);
+        return NULL;
+    }
+    sw->step_start = mono_ns();
+    return sw;
+}
+
+/* Print xrun and ISO failure rates of every setting of the sweep */
+static void
+sweep_summary(struct watch *w)
+{
+    const struct sweep *sw = w->sweep;
+    struct timespec wall;
+    char desc[160];
+
+    clock_gettime(CLOCK_REALTIME, &wall);
+    if (w->cfg->output == OUTPUT_TEXT) {
+        printf("Sweep results:\n  ");
+        for (int p = 0; p < sw->nparams; p++)
+            printf("%*s  ", (int)strlen(sw->params[p].name), sw->params[p].name);
+        printf("   secs  xruns/min  iso fail/min\n");
+    }
+
+    for (int i = 0; i <= sw->step && i < sw->nsteps; i++) {
+        const struct sweep_row *r = &sw->rows[i];
+        double mins = r->secs / 60;
+
+        if (r->secs <= 0)
+            continue;
+
+        if (w->cfg->output != OUTPUT_TEXT) {
+            sweep_describe(sw, i, desc, sizeof(desc));
+            emit_record(w, mono_ns(), &wall, "sweep_result", desc,
+                        r->xruns / mins, r->iso_fail / mins, NAN, NULL);
+            continue;
+        }
+
+        printf("  ");
+        for (int p = 0; p < sw->nparams; p++)
+            printf("%*d  ", (int)strlen(sw->params[p].name), sweep_value(sw, i, p));
+        printf("%7.0f  %9.2f  %12.2f\n", r->secs, r->xruns / mins, r->iso_fail / mins);
+    }
+}
+
+/*
+ * Per tick: count xruns and ISO failures against the current setting
+ * and move to the next one after the soak period.  After the last one
+ * the original values are restored and monitoring ends.
+ */
+static void
+sweep_tick(struct watch *w, const struct sample *smp, double elapsed,
+           const char *timestamp)
+{
+    struct sweep *sw = w->sweep;
+    struct sweep_row *r = &sw->rows[sw->step];
+    char desc[160];
+
+    if (!sw->active)
+        return;
+
+    r->xruns += w->roll.tick[ROLL_XRUNS];
+    r->iso_fail += w->roll.tick[ROLL_USB_ISO];
+    r->secs += elapsed;
+
+    if (smp->ts - sw->step_start < sw->soak_ns)
+        return;
+    sw->step_start = smp->ts;
+
+    if (sw->step + 1 == sw->nsteps || sweep_apply(sw, sw->step + 1) < 0) {
+        sweep_restore(sw);
+        sweep_summary(w);
+        running = 0;
+        return;
+    }
+
+    sw->step++;
+    sweep_describe(sw, sw->step, desc, sizeof(desc));
+    if (w->cfg->output != OUTPUT_TEXT)
+        emit_sample(w, smp, "sweep_step", desc, sw->step, sw->nsteps, NAN);
+    else
+        printf("[%s] Sweep %d/%d: %s\n", timestamp, sw->step + 1, sw->nsteps, desc);
+}
+
+/* Set up the rollup tiers, each covers the span of the next one */
+static void
+rollup_init(struct rollups *r)
+{
+    static const struct {
+        const char *name;
+        int width, nbuckets, quiet;
+    } tiers[ROLL_TIERS] = {
+        { "1s", 1, 60, 1 },         /* last minute */
+        { "1min", 60, 60, 0 },      /* last hour */
+        { "1h", 3600, 24, 0 },      /* last day */
+    };
+
+    memset(r, 0, sizeof(*r));
+    for (int t = 0; t < ROLL_TIERS; t++) {
+        struct rollup_tier *tier = &r->tiers[t];
+
+        tier->name = tiers[t].name;
+        tier->width = tiers[t].width;
+        tier->nbuckets = tiers[t].nbuckets;
+        tier->quiet = tiers[t].quiet;
+        for (int b = 0; b < tier->nbuckets; b++)
+            tier->buckets[b].id = -1;
+    }
+}
+
+/*
+ * Fold the counts of a tick into every tier.  Buckets are aligned to
+ * the wall clock and reused in a ring, so the cost per tick is constant
+ * and the memory is fixed.
+ */
+static void
+rollup_tick(struct rollups *r, const struct timespec *wall, double elapsed)
+{
+    for (int t = 0; t < ROLL_TIERS; t++) {
+        struct rollup_tier *tier = &r->tiers[t];
+        int64_t id = wall->tv_sec / tier->width;
+        struct rollup_bucket *b = &tier->buckets[tier->cur];
+
+        /* Buckets skipped over had no ticks, clear at most one lap */
+        if (b->id != id) {
+            int64_t steps = b->id < 0 || id < b->id ? 1 : id - b->id;
+
+            if (steps > tier->nbuckets)
+                steps = tier->nbuckets;
+            for (int64_t k = 0; k < steps; k++) {
+                tier->cur = (tier->cur + 1) % tier->nbuckets;
+                memset(&tier->buckets[tier->cur], 0, sizeof(*b));
+                tier->buckets[tier->cur].id = -1;
+            }
+            b = &tier->buckets[tier->cur];
+            b->id = id;
+        }
+
+        for (int m = 0; m < ROLL_METRICS; m++) {
+            double rate = r->tick[m] / elapsed;
+
+            b->sum[m] += r->tick[m];
+            if (rate > b->max[m])
+                b->max[m] = rate;
+        }
+        b->spikes += r->tick_spikes;
+        b->ticks++;
+        b->secs += elapsed;
+    }
+
+    for (int m = 0; m < ROLL_METRICS; m++)
+        r->total[m] += r->tick[m];
+    r->total_spikes += r->tick_spikes;
+    memset(r->tick, 0, sizeof(r->tick));
+    r->tick_spikes = 0;
+}
+
+/* Print every tier from the oldest bucket on */
+static void
+print_rollups(struct watch *w)
+{
+    static const char *names[ROLL_METRICS] = { "xruns", "usb_iso_fail", "usb_other_fail", "irq" };
+    const struct rollups *r = &w->roll;
+
+    for (int t = 0; t < ROLL_TIERS; t++) {
+        const struct rollup_tier *tier = &r->tiers[t];
+        int header = 0;
+
+        for (int k = 1; k <= tier->nbuckets; k++) {
+            const struct rollup_bucket *b = &tier->buckets[(tier->cur + k) % tier->nbuckets];
+            struct timespec start = { .tv_sec = (time_t)(b->id * tier->width) };
+            char timestamp[16];
+
+            if (b->id < 0 || b->ticks == 0)
+                continue;
+            if (tier->quiet && b->spikes == 0 && b->sum[ROLL_XRUNS] == 0 &&
+                b->sum[ROLL_USB_ISO] == 0 && b->sum[ROLL_USB_OTHER] == 0)
+                continue;
+
+            if (w->cfg->output != OUTPUT_TEXT) {
+                char event[16];
+
+                snprintf(event, sizeof(event), "rollup_%s", tier->name);
+                for (int m = 0; m < ROLL_METRICS; m++)
+                    emit_record(w, mono_ns(), &start, event, names[m],
+                                b->sum[m], b->max[m], NAN, NULL);
+                emit_record(w, mono_ns(), &start, event, "irq_spikes",
+                            b->spikes, NAN, NAN, NULL);
+                continue;
+            }
+
+            if (!header++)
+                printf("Rollup %-9s xruns usb iso usb other irq avg/s irq max/s spikes\n",
+                       tier->name);
+            format_timestamp(timestamp, sizeof(timestamp), &start, 0);
+            printf("  %-14s %5.0f %7.0f %9.0f %9.0f %9.0f %6u\n", timestamp,
+                   b->sum[ROLL_XRUNS], b->sum[ROLL_USB_ISO], b->sum[ROLL_USB_OTHER],
+                   b->secs > 0 ? b->sum[ROLL_IRQ] / b->secs : 0, b->max[ROLL_IRQ],
+                   b->spikes);
+        }
+    }
+}
+
+/* Print initial xruns and start the channel tables */
+static void
+initial_xruns(struct watch *w, const struct sample *smp, const char *timestamp)
+{
+    for (int i = 0; i < w->num_mons; i++) {
+        struct monitor *m = &w->mons[i];
+        const struct channel_xruns *ch = sample_channels(w, smp, i);
+        int n = smp->num_channels[i];
+
+        if (w->cfg->output != OUTPUT_TEXT) {
+            for (int j = 0; j < n; j++)
+                emit_sample(w, smp, "initial_xruns", ch[j].name,
+                            NAN, ch[j].xruns, NAN);
+        } else {
+            printf("[%s] Initial xruns:", timestamp);
+            for (int j = 0; j < n; j++) {
+                printf(" %s=%d", ch[j].name, ch[j].xruns);
+            }
+            printf("\n");
+        }
+
+        chan_update(&m->chans, ch, n, NULL);
+    }
+}
+
+/* Check xruns and buffer levels of every device */
+static void
+check_all_xruns(struct watch *w, const struct sample *smp, double elapsed,
+                const char *timestamp)
+{
+    (void)elapsed;
+
+    for (int i = 0; i < w->num_mons; i++)
+        check_xruns(w, &w->mons[i], smp, sample_channels(w, smp, i),
+                    smp->num_channels[i], timestamp);
+
+    if (w->bufs != NULL)
+        check_buffers(w, smp, timestamp);
+}
+
+#ifndef WITHOUT_USB
+/* Print initial USB failure counters */
+static void
+initial_usb(struct watch *w, const struct sample *smp, const char *timestamp)
+{
+    for (int i = 0; i < w->num_usb; i++) {
+        struct usb_source *u = &w->usbs[i];
+
+        if (smp->usb_ok[i] > 0)
+            u->prev = smp->usb[i];
+        if (w->cfg->output != OUTPUT_TEXT) {
+            emit_sample(w, smp, "initial_usb_control_fail", u->ugen, NAN, u->prev.ctrl_fail, NAN);
+            emit_sample(w, smp, "initial_usb_isochronous_fail", u->ugen, NAN, u->prev.iso_fail, NAN);
+            emit_sample(w, smp, "initial_usb_bulk_fail", u->ugen, NAN, u->prev.bulk_fail, NAN);
+            emit_sample(w, smp, "initial_usb_interrupt_fail", u->ugen, NAN, u->prev.int_fail, NAN);
+            continue;
+        }
+        printf("[%s] Initial USB: %sCTRL=%d ISO=%d BULK=%d INT=%d\n",
+               timestamp, u->label, u->prev.ctrl_fail, u->prev.iso_fail,
+               u->prev.bulk_fail, u->prev.int_fail);
+    }
+}
+
+/* Check USB errors of every device that answered */
+static void
+check_all_usb(struct watch *w, const struct sample *smp, double elapsed,
+              const char *timestamp)
+{
+    (void)elapsed;
+
+    for (int i = 0; i < w->num_usb; i++) {
+        if (smp->usb_ok[i] >= 0)
+            check_usb(w, &w->usbs[i], smp, smp->usb_ok[i], &smp->usb[i], timestamp);
+    }
+}
+#endif
+
+#ifndef WITHOUT_IRQ
+/* Start interrupt counting from the first sample, calibration follows */
+static void
+initial_irq(struct watch *w, const struct sample *smp, const char *timestamp)
+{
+    for (int i = 0; i < w->num_irq; i++)
+        w->irqs[i].prev_count = smp->irq[i];
+
+    if (w->scan != NULL)
+        memcpy(w->scan->prev, smp->intr, w->scan->n * sizeof(*smp->intr));
+
+    if (w->num_irq > 0 && w->cfg->output == OUTPUT_TEXT)
+        printf("[%s] Initial IRQ: calibrating...\n", timestamp);
+}
+
+/* Check the rate of every controller interrupt */
+static void
+check_all_irq(struct watch *w, const struct sample *smp, double elapsed,
+              const char *timestamp)
+{
+    for (int i = 0; i < w->num_irq; i++)
+        check_irq(w, &w->irqs[i], smp, smp->irq[i], elapsed, timestamp);
+}
+#endif
+
+static int
+xruns_enabled(const struct watch *w)
+{
+    return w->cfg->show_xruns;
+}
+
+#ifndef WITHOUT_USB
+static int
+usb_enabled(const struct watch *w)
+{
+    return w->num_usb > 0;
+}
+#endif
+
+#ifndef WITHOUT_IRQ
+static int
+irq_enabled(const struct watch *w)
+{
+    return w->num_irq > 0 || w->scan != NULL;
+}
+#endif
+
+/* Collectors in the order they are sampled and checked */
+static const struct collector collectors[] = {
+    { "xruns", xruns_enabled, collect_xruns, initial_xruns, check_all_xruns },
+#ifndef WITHOUT_USB
+    { "usb", usb_enabled, collect_usb, initial_usb, check_all_usb },
+#endif
+#ifndef WITHOUT_IRQ
+    { "irq", irq_enabled, collect_irq, initial_irq, check_all_irq },
+#endif
+};
+
+/* Print initial values from the first sample */
+static void
+report_initial(struct watch *w, const struct sample *smp, const char *timestamp)
+{
+    for (int i = 0; i < w->num_active; i++)
+        w->active[i]->initial(w, smp, timestamp);
+
+    if (w->ncpu > 0) {
+        memcpy(w->prev_cp_times, smp->cp_times,
+               (size_t)w->ncpu * CPUSTATES * sizeof(*smp->cp_times));
+        for (int i = 0; i < w->num_irq; i++) {
+            struct irq_source *q = &w->irqs[i];
+
+            q->cpu = smp->irq_cpu[i];
+            if (w->cfg->output != OUTPUT_TEXT)
+                emit_sample(w, smp, "irq_cpu", q->irq, NAN, q->cpu, NAN);
+            else if (q->cpu >= 0)
+                printf("[%s] %s (%s) bound to CPU %d\n",
+                       timestamp, q->irq, q->controller, q->cpu);
+            else
+                printf("[%s] %s (%s) not bound, may run on any CPU\n",
+                       timestamp, q->irq, q->controller);
+        }
+    }
+}
+
+/* Append formatted text to the metrics buffer, dropping what won't fit */
+static void
+metrics_printf(struct metrics_buf *m, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (m->len >= sizeof(m->data))
+        return;
+
+    va_start(ap, fmt);
+    n = vsnprintf(m->data + m->len, sizeof(m->data) - m->len, fmt, ap);
+    va_end(ap);
+
+    if (n > 0)
+        m->len += (size_t)n < sizeof(m->data) - m->len ? (size_t)n : sizeof(m->data) - m->len;
+}
+
+/* Render current counters as OpenMetrics text */
+static void
+metrics_render(struct watch *w)
+{
+    struct metrics_buf *m = w->metrics;
+    const struct latency_hist *h = &w->lat;
+
+    atomic_fetch_add_explicit(&m->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    m->len = 0;
+
+    if (w->cfg->show_xruns) {
+        metrics_printf(m, "# TYPE sndchk_xruns counter\n"
+                       "# HELP sndchk_xruns Buffer underruns/overruns per channel.\n");
+        for (int i = 0; i < w->num_mons; i++) {
+            const struct monitor *mon = &w->mons[i];
+            const struct chan_table *t = &mon->chans;
+
+            for (int j = 0; j < t->num_order; j++) {
+                metrics_printf(m, "sndchk_xruns_total{unit=\"%d\",channel=\"%s\"} %d\n",
+                               atomic_load_explicit(&mon->unit, memory_order_relaxed),
+                               t->names[t->order[j]],
+                               t->xruns[t->order[j]]);
+            }
+        }
+    }
+
+#ifndef WITHOUT_USB
+    if (w->num_usb > 0) {
+        static const char *usb_types[] = { "control", "isochronous", "bulk", "interrupt" };
+
+        metrics_printf(m, "# TYPE sndchk_usb_transfer_failures counter\n"
+                       "# HELP sndchk_usb_transfer_failures USB transfer failures by type.\n");
+        for (int i = 0; i < w->num_usb; i++) {
+            const struct usb_source *u = &w->usbs[i];
+            int vals[4] = { u->prev.ctrl_fail, u->prev.iso_fail,
+                            u->prev.bulk_fail, u->prev.int_fail };
+
+            for (int t = 0; t < 4; t++) {
+                metrics_printf(m, "sndchk_usb_transfer_failures_total{ugen=\"%s\",type=\"%s\"} %d\n",
+                               u->ugen, usb_types[t], vals[t]);
+            }
+        }
+    }
+#endif
+
+    if (w->num_irq > 0) {
+        metrics_printf(m, "# TYPE sndchk_irq_rate gauge\n"
+                       "# HELP sndchk_irq_rate Interrupts per second on the USB controller.\n");
+        for (int i = 0; i < w->num_irq; i++)
+            metrics_printf(m, "sndchk_irq_rate{controller=\"%s\"} %ld\n",
+                           w->irqs[i].controller, w->irqs[i].rate);
+
+        metrics_printf(m, "# TYPE sndchk_irq_baseline gauge\n"
+                       "# HELP sndchk_irq_baseline Adaptive baseline of the interrupt rate.\n");
+        for (int i = 0; i < w->num_irq; i++)
+            metrics_printf(m, "sndchk_irq_baseline{controller=\"%s\"} %.1f\n",
+                           w->irqs[i].controller, w->irqs[i].mean);
+
+        metrics_printf(m, "# TYPE sndchk_irq_spikes counter\n"
+                       "# HELP sndchk_irq_spikes Interrupt rate spikes detected.\n");
+        for (int i = 0; i < w->num_irq; i++)
+            metrics_printf(m, "sndchk_irq_spikes_total{controller=\"%s\"} %lu\n",
+                           w->irqs[i].controller, w->irqs[i].spikes);
+    }
+
+    if (h->count > 0) {
+        metrics_printf(m, "# TYPE sndchk_wakeup_latency_seconds summary\n"
+                       "# UNIT sndchk_wakeup_latency_seconds seconds\n"
+                       "# HELP sndchk_wakeup_latency_seconds Lateness of sampler wakeups.\n"
+                       "sndchk_wakeup_latency_seconds{quantile=\"0.5\"} %.6f\n"
+                       "sndchk_wakeup_latency_seconds{quantile=\"0.99\"} %.6f\n"
+                       "sndchk_wakeup_latency_seconds{quantile=\"0.999\"} %.6f\n"
+                       "sndchk_wakeup_latency_seconds_sum %.6f\n"
+                       "sndchk_wakeup_latency_seconds_count %ju\n",
+                       lat_percentile(h, 0.5) / 1e6, lat_percentile(h, 0.99) / 1e6,
+                       lat_percentile(h, 0.999) / 1e6, h->sum / 1e6,
+                       (uintmax_t)h->count);
+    }
+
+    metrics_printf(m, "# EOF\n");
+
+    atomic_thread_fence(memory_order_release);
+    atomic_fetch_add_explicit(&m->seq, 1, memory_order_relaxed);
+}
+
+/*
+ * Copy a consistent snapshot of the metrics, returns its length or -1
+ * if it is still being rewritten after METRICS_RETRIES tries, e.g. the
+ * writer died in the middle.
+ */
+static ssize_t
+metrics_copy(struct metrics_buf *m, char *buf, size_t len)
+{
+    unsigned seq;
+    size_t n;
+    int tries = 0;
+
+    do {
+        while ((seq = atomic_load_explicit(&m->seq, memory_order_acquire)) & 1) {
+            if (++tries >= METRICS_RETRIES)
+                return -1;
+        }
+        n = m->len < len ? m->len : len;
+        memcpy(buf, m->data, n);
+        atomic_thread_fence(memory_order_acquire);
+        if (++tries >= METRICS_RETRIES)
+            return -1;
+    } while (atomic_load_explicit(&m->seq, memory_order_relaxed) != seq);
+
+    return n;
+}
+
+/*
+ * Create the shared memory snapshot for -D.  A segment left behind by a
+ * daemon that is gone is replaced, a running one is left alone.
+ */
+static struct shm_segment *
+shm_publish(void)
+{
+    struct shm_segment *seg;
+    int fd;
+
+    for (int tries = 0; ; tries++) {
+        if ((fd = shm_open(SHM_NAME, O_RDWR | O_CREAT | O_EXCL, 0644)) >= 0)
+            break;
+        if (errno != EEXIST || tries > 0) {
+            perror("Cannot create shared memory " SHM_NAME);
+            return NULL;
+        }
+
+        if ((fd = shm_open(SHM_NAME, O_RDONLY, 0)) >= 0) {
+            pid_t pid = 0;
+
+            seg = mmap(NULL, sizeof(*seg), PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (seg != MAP_FAILED) {
+                pid = seg->pid;
+                munmap(seg, sizeof(*seg));
+            }
+            if (pid > 0 && kill(pid, 0) == 0) {
+                fprintf(stderr, "Error: sndchk daemon already running (pid %d)\n",
+                        (int)pid);
+                return NULL;
+            }
+        }
+        shm_unlink(SHM_NAME);
+    }
+
+    if (ftruncate(fd, sizeof(*seg)) < 0 ||
+        (seg = mmap(NULL, sizeof(*seg), PROT_READ | PROT_WRITE, MAP_SHARED,
+                    fd, 0)) == MAP_FAILED) {
+        perror("Cannot map shared memory " SHM_NAME);
+        close(fd);
+        shm_unlink(SHM_NAME);
+        return NULL;
+    }
+    close(fd);
+
+    memcpy(seg->magic, SHM_MAGIC, sizeof(seg->magic));
+    seg->version = SHM_VERSION;
+    seg->pid = getpid();
+    return seg;
+}
+
+/* Remove the -D snapshot on exit */
+static void
+shm_unpublish(struct shm_segment *seg)
+{
+    shm_unlink(SHM_NAME);
+    munmap(seg, sizeof(*seg));
+}
+
+/* -q: print the snapshot of a running daemon */
+static int
+shm_query(void)
+{
+    static char buf[METRICS_MAX];
+    struct shm_segment *seg;
+    struct stat st;
+    ssize_t n;
+    int fd;
+
+    if ((fd = shm_open(SHM_NAME, O_RDONLY, 0)) < 0) {
+        fprintf(stderr, "No sndchk daemon running (start one with -D)\n");
+        return 1;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*seg) ||
+        (seg = mmap(NULL, sizeof(*seg), PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot map shared memory %s\n", SHM_NAME);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    if (memcmp(seg->magic, SHM_MAGIC, sizeof(seg->magic)) != 0 ||
+        seg->version != SHM_VERSION) {
+        fprintf(stderr, "Error: %s is not a sndchk snapshot of this version\n", SHM_NAME);
+        munmap(seg, sizeof(*seg));
+        return 1;
+    }
+    int dead = kill(seg->pid, 0) < 0 && errno == ESRCH;
+
+    if (dead)
+        fprintf(stderr, "Warning: daemon (pid %d) is gone, snapshot is stale\n",
+                (int)seg->pid);
+
+    if ((n = metrics_copy(&seg->metrics, buf, sizeof(buf))) < 0) {
+        fprintf(stderr, "Error: %s is inconsistent, %s\n", SHM_NAME,
+                dead ? "the daemon died while writing it" : "the daemon is stuck writing it");
+        munmap(seg, sizeof(*seg));
+        return 1;
+    }
+    fwrite(buf, 1, n, stdout);
+    munmap(seg, sizeof(*seg));
+    return 0;
+}
+
+#ifndef WITHOUT_EXPORTER
+/* Listen on host:port for scrapes, registering with the kqueue */
+static int
+exporter_start(struct exporter *ex, const char *addr, int kq)
+{
+    struct addrinfo hints, *res, *ai;
+    struct kevent ev;
+    char host[256];
+    const char *port;
+    int one = 1;
+    int err;
+
+    ex->listen_fd = -1;
+    for (int i = 0; i < HTTP_CLIENTS; i++)
+        ex->clients[i].fd = -1;
+
+    /* Split "host:port", "[v6addr]:port" or ":port" */
+    port = strrchr(addr, ':');
+    if (port == NULL || port[1] == '\0') {
+        fprintf(stderr, "Error: exporter address must be host:port\n");
+        return -1;
+    }
+    snprintf(host, sizeof(host), "%.*s", (int)(port - addr), addr);
+    port++;
+    if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+        memmove(host, host + 1, strlen(host));
+        host[strlen(host) - 1] = '\0';
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if ((err = getaddrinfo(host[0] && strcmp(host, "*") != 0 ? host : NULL,
+                           port, &hints, &res)) != 0) {
+        fprintf(stderr, "Error: %s: %s\n", addr, gai_strerror(err));
+        return -1;
+    }
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        ex->listen_fd = socket(ai->ai_family,
+                               ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                               ai->ai_protocol);
+        if (ex->listen_fd < 0)
+            continue;
+
+        setsockopt(ex->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(ex->listen_fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+            listen(ex->listen_fd, HTTP_CLIENTS) == 0)
+            break;
+
+        close(ex->listen_fd);
+        ex->listen_fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (ex->listen_fd < 0) {
+        fprintf(stderr, "Error: cannot listen on %s: %s\n", addr, strerror(errno));
+        return -1;
+    }
+
+    EV_SET(&ev, ex->listen_fd, EVFILT_READ, EV_ADD, 0, 0, ex);
+    if (kevent(kq, &ev, 1, NULL, 0, NULL) < 0) {
+        close(ex->listen_fd);
+        ex->listen_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Drop a client connection */
+static void
+http_close(struct http_client *c)
+{
+    /* Closing the descriptor removes its kevents */
+    close(c->fd);
+    c->fd = -1;
+}
+
+/* Build the response once the request headers are complete */
+static void
+http_respond(struct exporter *ex, struct http_client *c)
+{
+    static const char hdr[] =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+        "Connection: close\r\n"
+        "Content-Length: %zu\r\n\r\n";
+    static const char not_found[] =
+        "HTTP/1.1 404 Not Found\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 0\r\n\r\n";
+    static char body[METRICS_MAX];
+    ssize_t n;
+
+    if (strncmp(c->in, "GET /metrics ", 13) != 0 && strncmp(c->in, "GET / ", 6) != 0) {
+        memcpy(c->out, not_found, sizeof(not_found) - 1);
+        c->out_len = sizeof(not_found) - 1;
+        return;
+    }
+
+    /* The writer is this process, it can only have been cut short */
+    if ((n = metrics_copy(ex->metrics, body, sizeof(body))) < 0)
+        n = 0;
+    c->out_len = snprintf(c->out, sizeof(c->out), hdr, (size_t)n);
+    memcpy(c->out + c->out_len, body, n);
+    c->out_len += n;
+}
+
+/*
+ * Handle an exporter event: a new connection, request data or room to
+ * send the response.  Returns 0 if the event wasn't for the exporter.
+ */
+static int
+exporter_event(struct exporter *ex, int kq, const struct kevent *ev)
+{
+    struct http_client *c = ev->udata;
+    struct kevent kev[2];
+    ssize_t n;
+
+    if (ev->udata == ex && (int)ev->ident == ex->listen_fd) {
+        int fd = accept4(ex->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0)
+            return 1;
+
+        for (int i = 0; i < HTTP_CLIENTS; i++) {
+            if (ex->clients[i].fd < 0) {
+                c = &ex->clients[i];
+                c->fd = fd;
+                c->in_len = c->out_len = c->out_off = 0;
+                EV_SET(&kev[0], fd, EVFILT_READ, EV_ADD, 0, 0, c);
+                if (kevent(kq, kev, 1, NULL, 0, NULL) < 0)
+                    http_close(c);
+                return 1;
+            }
+        }
+
+        /* All slots busy, the scraper will retry */
+        close(fd);
+        return 1;
+    }
+
+    if (c < ex->clients || c >= ex->clients + HTTP_CLIENTS || c->fd != (int)ev->ident)
+        return 0;
+
+    if (ev->filter == EVFILT_READ) {
+        n = read(c->fd, c->in + c->in_len, sizeof(c->in) - 1 - c->in_len);
+        if (n <= 0) {
+            if (n < 0 && errno == EAGAIN)
+                return 1;
+            http_close(c);
+            return 1;
+        }
+        c->in_len += n;
+        c->in[c->in_len] = '\0';
+
+        if (strstr(c->in, "\r\n\r\n") == NULL && strstr(c->in, "\n\n") == NULL) {
+            if (c->in_len >= sizeof(c->in) - 1)
+                http_close(c);
+            return 1;
+        }
+
+        http_respond(ex, c);
+        EV_SET(&kev[0], c->fd, EVFILT_READ, EV_DELETE, 0, 0, c);
+        EV_SET(&kev[1], c->fd, EVFILT_WRITE, EV_ADD, 0, 0, c);
+        if (kevent(kq, kev, 2, NULL, 0, NULL) < 0)
+            http_close(c);
+        return 1;
+    }
+
+    if (ev->filter == EVFILT_WRITE) {
+        n = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+        if (n < 0 && errno == EAGAIN)
+            return 1;
+        if (n <= 0 || (c->out_off += n) == c->out_len)
+            http_close(c);
+    }
+
+    return 1;
+}
+#endif
+
+/* Diff a sample against the previous one and print what changed */
+static void
+report_sample(struct watch *w, const struct sample *smp)
+{
+    char timestamp[16];
+
+    format_timestamp(timestamp, sizeof(timestamp), &smp->wall, w->msec);
+
+    if (smp->type == SAMPLE_INFO) {
+        print_latency(w, &w->lat);
+        print_intr_top(w);
+        print_buffers(w);
+        print_rollups(w);
+        return;
+    }
+
+    if (smp->type == SAMPLE_DETACH) {
+        struct usb_source *u = &w->usbs[smp->source];
+
+        if (!u->down) {
+            u->down = 1;
+            u->down_ts = smp->ts;
+        }
+        if (w->cfg->output != OUTPUT_TEXT)
+            emit_sample(w, smp, "usb_detach", u->ugen, NAN, NAN, NAN);
+        else
+            printf("[%s] USB WARNING: ugen%s detached\n", timestamp, u->ugen);
+        return;
+    }
+
+    if (smp->type == SAMPLE_ATTACH) {
+        struct usb_source *u = &w->usbs[smp->source];
+        double gap = u->down ? (double)(smp->ts - u->down_ts) / NSEC_PER_SEC : NAN;
+        int moved = strcmp(smp->ugen, u->ugen) != 0;
+        char was[32], after[32] = "";
+
+        /* Same device, the downtime stays visible as a gap */
+        if (w->cfg->output != OUTPUT_TEXT) {
+            snprintf(was, sizeof(was), "was=ugen%s", u->ugen);
+            emit_record(w, smp->ts, &smp->wall, "usb_attach", smp->ugen,
+                        NAN, NAN, gap, moved ? was : NULL);
+        } else {
+            if (!isnan(gap))
+                snprintf(after, sizeof(after), " after %.1f s down", gap);
+            if (moved)
+                printf("[%s] USB: ugen%s reattached as ugen%s%s\n",
+                       timestamp, u->ugen, smp->ugen, after);
+            else
+                printf("[%s] USB: ugen%s attached%s\n", timestamp, u->ugen, after);
+        }
+
+        snprintf(u->ugen, sizeof(u->ugen), "%s", smp->ugen);
+        if (u->label[0] != '\0')
+            snprintf(u->label, sizeof(u->label), "ugen%s ", u->ugen);
+        u->down = 0;
+        if (smp->usb_ok[smp->source] > 0)
+            u->prev = smp->usb[smp->source];
+        return;
+    }
+
+    if (!w->started) {
+        report_initial(w, smp, timestamp);
+        w->prev_ts = smp->ts;
+        w->started = 1;
+        if (w->metrics != NULL)
+            metrics_render(w);
+        return;
+    }
+
+    double elapsed = (double)(smp->ts - w->prev_ts) / NSEC_PER_SEC;
+    w->prev_ts = smp->ts;
+    w->now = smp->ts;
+
+    if (smp->late >= 0)
+        lat_record(&w->lat, smp->late);
+
+    /* Report incident whose window ended before this sample */
+    if (w->cfg->corr_window > 0)
+        incident_expire(w);
+
+    if (HAVE_IRQ && w->scan != NULL)
+        intr_scan_update(w, smp->intr, elapsed);
+    if (w->ncpu > 0) {
+        cpu_update(w, smp);
+        check_irq_cpu(w, smp, timestamp);
+    }
+    w->xrun_tick = 0;
+
+    for (int i = 0; i < w->num_active; i++)
+        w->active[i]->check(w, smp, elapsed, timestamp);
+
+    /* Whatever else was busy when audio broke up */
+    if (HAVE_IRQ && w->scan != NULL && w->xrun_tick)
+        intr_scan_report(w, smp, timestamp);
+    if (w->ncpu > 0)
+        cpu_report(w, smp, timestamp);
+
+    if (w->stress != NULL)
+        stress_tick(w, smp, timestamp);
+    if (w->sweep != NULL)
+        sweep_tick(w, smp, elapsed, timestamp);
+    rollup_tick(&w->roll, &smp->wall, elapsed);
+
+    if (w->metrics != NULL)
+        metrics_render(w);
+}
+
+/* Reserve the next free ring slot, NULL when the consumer is behind */
+static struct sample *
+ring_reserve(struct sample_ring *r)
+{
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+    if (head - tail >= RING_SLOTS)
+        return NULL;
+
+    return &r->slots[head & (RING_SLOTS - 1)];
+}
+
+/* Publish the reserved slot to the consumer */
+static void
+ring_commit(struct sample_ring *r)
+{
+    atomic_fetch_add_explicit(&r->head, 1, memory_order_release);
+    sem_post(&r->avail);
+}
+
+/* Wait for the oldest sample, NULL once the producer is done */
+static const struct sample *
+ring_peek(struct sample_ring *r)
+{
+    for (;;) {
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+        if (head != tail)
+            return &r->slots[tail & (RING_SLOTS - 1)];
+        if (atomic_load_explicit(&r->done, memory_order_acquire))
+            return NULL;
+
+        while (sem_wait(&r->avail) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+/* Hand the oldest sample back to the producer */
+static void
+ring_release(struct sample_ring *r)
+{
+    atomic_fetch_add_explicit(&r->tail, 1, memory_order_release);
+}
+
+/* Size of one trace record for the watched sources */
+static size_t
+trace_record_size(int num_mons, int max_channels, int num_usb, int num_irq)
+{
+    size_t size = sizeof(struct trace_record) +
+        num_mons * (sizeof(int32_t) + max_channels * sizeof(struct trace_channel)) +
+        num_usb * sizeof(struct trace_usb) +
+        num_irq * sizeof(int64_t);
+
+    return (size + 7) & ~(size_t)7;
+}
+
+/* Offset of the first record, header and device list padded to a page */
+static size_t
+trace_data_offset(int num_devices)
+{
+    size_t page = getpagesize();
+    size_t size = sizeof(struct trace_header) +
+        num_devices * sizeof(((struct trace_header *)NULL)->devices[0]);
+
+    return (size + page - 1) & ~(page - 1);
+}
+
+/* Create and map a preallocated trace file for recording */
+static int
+trace_create(struct trace *t, const char *path, size_t mb, const struct watch *w)
+{
+    size_t rsize = trace_record_size(w->num_mons, w->max_channels, w->num_usb, w->num_irq);
+    size_t off = trace_data_offset(w->num_mons);
+    uint64_t capacity = (mb * 1024 * 1024 - off) / rsize;
+    struct trace_header *h;
+
+    if (mb * 1024 * 1024 <= off + rsize) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((t->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+        return -1;
+
+    t->map_len = off + capacity * rsize;
+    if (ftruncate(t->fd, t->map_len) < 0) {
+        close(t->fd);
+        return -1;
+    }
+    /* Reserve the blocks now where supported (not on ZFS) */
+    posix_fallocate(t->fd, 0, t->map_len);
+
+    /* MAP_NOSYNC keeps the syncer from flushing pages behind our back */
+    t->hdr = mmap(NULL, t->map_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_NOSYNC, t->fd, 0);
+    if (t->hdr == MAP_FAILED) {
+        close(t->fd);
+        return -1;
+    }
+    t->records = (char *)t->hdr + off;
+
+    h = t->hdr;
+    memcpy(h->magic, TRACE_MAGIC, sizeof(h->magic));
+    h->version = TRACE_VERSION;
+    h->record_size = rsize;
+    h->capacity = capacity;
+    h->count = 0;
+    h->interval = w->cfg->interval;
+    h->play_only = w->cfg->play_only;
+    h->show_xruns = w->cfg->show_xruns;
+    h->show_usb = w->cfg->show_usb;
+    h->num_devices = w->num_mons;
+    h->max_channels = w->max_channels;
+
+    for (int i = 0; i < w->num_mons; i++) {
+        const struct pcm_device *dev = w->mons[i].dev;
+
+        h->devices[i].unit = dev->unit;
+        h->devices[i].is_usb = dev->is_usb;
+        snprintf(h->devices[i].desc, sizeof(h->devices[i].desc), "%s", dev->desc);
+        snprintf(h->devices[i].ugen, sizeof(h->devices[i].ugen), "%s", dev->ugen);
+        snprintf(h->devices[i].controller, sizeof(h->devices[i].controller), "%s", dev->controller);
+        snprintf(h->devices[i].irq, sizeof(h->devices[i].irq), "%s", dev->irq);
+    }
+
+    return 0;
+}
+
+/* Map an existing trace file for replay */
+static int
+trace_open(struct trace *t, const char *path)
+{
+    struct trace_header *h;
+    struct stat sb;
+
+    if ((t->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+
+    if (fstat(t->fd, &sb) < 0 || (size_t)sb.st_size < trace_data_offset(0)) {
+        close(t->fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    t->map_len = sb.st_size;
+    t->hdr = mmap(NULL, t->map_len, PROT_READ, MAP_SHARED, t->fd, 0);
+    if (t->hdr == MAP_FAILED) {
+        close(t->fd);
+        return -1;
+    }
+
+    h = t->hdr;
+    if (memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != TRACE_VERSION ||
+        h->num_devices < 1 || h->max_channels < 1 ||
+        trace_data_offset(h->num_devices) > t->map_len ||
+        h->record_size == 0 ||
+        trace_data_offset(h->num_devices) + h->capacity * h->record_size > t->map_len) {
+        munmap(t->hdr, t->map_len);
+        close(t->fd);
+        errno = EINVAL;
+        return -1;
+    }
+    t->records = (char *)t->hdr + trace_data_offset(h->num_devices);
+
+    return 0;
+}
+
+/* Unmap trace, flushing recorded data */
+static void
+trace_close(struct trace *t, int written)
+{
+    if (written)
+        msync(t->hdr, t->map_len, MS_SYNC);
+    munmap(t->hdr, t->map_len);
+    close(t->fd);
+}
+
+/* Append a sample, overwriting the oldest record once the file is full */
+static void
+trace_write(struct trace *t, const struct watch *w, const struct sample *smp)
+{
+    struct trace_header *h = t->hdr;
+    char *p = t->records + (h->count % h->capacity) * h->record_size;
+    struct trace_record *rec = (struct trace_record *)p;
+
+    rec->ts = smp->ts;
+    rec->wall_sec = smp->wall.tv_sec;
+    rec->wall_nsec = smp->wall.tv_nsec;
+    rec->type = smp->type;
+    rec->source = smp->source;
+    rec->late = smp->late;
+    memcpy(rec->ugen, smp->ugen, sizeof(rec->ugen));
+    p += sizeof(*rec);
+
+    for (int i = 0; i < w->num_mons; i++) {
+        int32_t n = w->cfg->show_xruns ? smp->num_channels[i] : 0;
+        struct trace_channel *tc;
+        const struct channel_xruns *ch = sample_channels(w, smp, i);
+
+        memcpy(p, &n, sizeof(n));
+        p += sizeof(n);
+        tc = (struct trace_channel *)p;
+        for (int j = 0; j < n; j++) {
+            tc[j].xruns = ch[j].xruns;
+            snprintf(tc[j].name, sizeof(tc[j].name), "%s", ch[j].name);
+        }
+        p += w->max_channels * sizeof(*tc);
+    }
+
+    for (int i = 0; i < w->num_usb; i++) {
+        struct trace_usb *tu = (struct trace_usb *)p;
+
+        tu->ok = smp->usb_ok[i];
+        tu->stats = smp->usb[i];
+        p += sizeof(*tu);
+    }
+
+    for (int i = 0; i < w->num_irq; i++) {
+        int64_t count = smp->irq[i];
+
+        memcpy(p, &count, sizeof(count));
+        p += sizeof(count);
+    }
+
+    h->count++;
+}
+
+/* Decode record number n (counted from the start of recording) */
+static void
+trace_read(const struct trace *t, const struct watch *w, uint64_t n,
+           struct sample *smp)
+{
+    const struct trace_header *h = t->hdr;
+    const char *p = t->records + (n % h->capacity) * h->record_size;
+    const struct trace_record *rec = (const struct trace_record *)p;
+
+    smp->ts = rec->ts;
+    smp->wall.tv_sec = rec->wall_sec;
+    smp->wall.tv_nsec = rec->wall_nsec;
+    smp->type = rec->type;
+    smp->source = rec->source;
+    smp->late = rec->late;
+    snprintf(smp->ugen, sizeof(smp->ugen), "%.*s", (int)sizeof(rec->ugen), rec->ugen);
+    p += sizeof(*rec);
+
+    for (int i = 0; i < w->num_mons; i++) {
+        struct channel_xruns *ch = sample_channels(w, smp, i);
+        const struct trace_channel *tc;
+        int32_t n;
+
+        memcpy(&n, p, sizeof(n));
+        p += sizeof(n);
+        if (n < 0 || n > w->max_channels)
+            n = 0;
+        smp->num_channels[i] = n;
+        tc = (const struct trace_channel *)p;
+        for (int j = 0; j < n; j++) {
+            ch[j].xruns = tc[j].xruns;
+            snprintf(ch[j].name, sizeof(ch[j].name), "%.*s", TRACE_NAME_LEN, tc[j].name);
+        }
+        p += w->max_channels * sizeof(*tc);
+    }
+
+    for (int i = 0; i < w->num_usb; i++) {
+        const struct trace_usb *tu = (const struct trace_usb *)p;
+
+        smp->usb_ok[i] = tu->ok;
+        smp->usb[i] = tu->stats;
+        p += sizeof(*tu);
+    }
+
+    for (int i = 0; i < w->num_irq; i++) {
+        int64_t count;
+
+        memcpy(&count, p, sizeof(count));
+        smp->irq[i] = count;
+        p += sizeof(count);
+    }
+}
+
+/*
+ * Wait for the next event and fill smp.  Returns 1 for a sample, 0 for
+ * nothing to report and -1 when monitoring should stop.
+ */
+static int
+next_event(struct watch *w, struct sample *smp)
+{
+    struct kevent ev;
+
+    if (kevent(w->kq, NULL, 0, &ev, 1, NULL) < 0) {
+        if (errno == EINTR)
+            return 0;
+        perror("kevent");
+        return -1;
+    }
+
+    if (ev.filter == EVFILT_SIGNAL && ev.ident == SIGINFO) {
+        smp->type = SAMPLE_INFO;
+        smp->ts = mono_ns();
+        smp->late = -1;
+        clock_gettime(CLOCK_REALTIME, &smp->wall);
+        return 1;
+    }
+
+    if (ev.filter == EVFILT_SIGNAL)
+        return -1;
+
+#ifndef WITHOUT_EXPORTER
+    if (w->exporter != NULL && exporter_event(w->exporter, w->kq, &ev))
+        return 0;
+#endif
+
+#ifndef WITHOUT_USB
+    if (ev.filter == EVFILT_READ && (int)ev.ident == w->devd_fd) {
+        if (!take_usb_event(w, smp))
+            return 0;
+    } else
+#endif
+    if (ev.filter == EVFILT_TIMER && ev.ident == 2) {
+        /* Buffer probe between ticks, nothing to report yet */
+        nvlist_t *nvl = fetch_channels();
+
+        if (nvl != NULL) {
+            probe_all_buffers(w, nvl);
+            nvlist_destroy(nvl);
+        }
+        return 0;
+    } else if (ev.filter == EVFILT_TIMER) {
+        /* data counts expirations since the last event */
+        uint64_t now = mono_ns();
+        int found = 0;
+
+        w->deadline += ev.data * w->period;
+        /* A device found again takes this tick, the next one covers both */
+#ifndef WITHOUT_USB
+        found = w->devd_fd < 0 && usb_rescan(w, smp);
+#endif
+        if (!found) {
+            take_sample(w, smp);
+            smp->late = now > w->deadline ? (int64_t)(now - w->deadline) : 0;
+        }
+    } else {
+        return 0;
+    }
+
+    if (w->trace != NULL && smp->type != SAMPLE_INFO)
+        trace_write(w->trace, w, smp);
+    return 1;
+}
+
+/* Sampler thread, feeds the ring until a termination signal arrives */
+static void *
+sampler_thread(void *arg)
+{
+    struct watch *w = arg;
+
+    if (w->cfg->sampler_cpu >= 0) {
+        cpuset_t mask;
+
+        CPU_ZERO(&mask);
+        CPU_SET(w->cfg->sampler_cpu, &mask);
+        if ((errno = pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask)) != 0)
+            perror("Warning: cannot pin sampler thread");
+    }
+
+    if (w->cfg->sampler_rtprio >= 0) {
+        struct rtprio rtp = {
+            .type = RTP_PRIO_REALTIME,
+            .prio = w->cfg->sampler_rtprio
+        };
+
+        if (rtprio_thread(RTP_SET, 0, &rtp) < 0)
+            perror("Warning: cannot set sampler realtime priority");
+    }
+
+    while (running) {
+        /* Sample straight into the ring, or into the spare when it is full */
+        struct sample *smp = ring_reserve(&w->ring);
+        int r = next_event(w, smp != NULL ? smp : &w->ring.spare);
+
+        if (r < 0)
+            running = 0;
+        else if (r > 0 && smp != NULL)
+            ring_commit(&w->ring);
+        else if (r > 0)
+            atomic_fetch_add_explicit(&w->ring.dropped, 1, memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&w->ring.done, 1, memory_order_release);
+    sem_post(&w->ring.avail);
+    return NULL;
+}
+
+/* Report samples from the ring until the sampler stops */
+static void
+reporter_loop(struct watch *w)
+{
+    const struct sample *smp;
+    unsigned dropped;
+
+    while ((smp = ring_peek(&w->ring)) != NULL) {
+        dropped = atomic_exchange_explicit(&w->ring.dropped, 0, memory_order_relaxed);
+        if (dropped > 0) {
+            char timestamp[16];
+
+            format_timestamp(timestamp, sizeof(timestamp), &smp->wall, w->msec);
+            if (w->cfg->output != OUTPUT_TEXT)
+                emit_sample(w, smp, "dropped", "sampler", NAN, dropped, NAN);
+            else
+                printf("[%s] WARNING: %u samples dropped, output too slow\n",
+                       timestamp, dropped);
+        }
+
+        report_sample(w, smp);
+        ring_release(&w->ring);
+        fflush(stdout);
+    }
+}
+
+/* Microseconds since start */
+static double
+elapsed_us(uint64_t start)
+{
+    return (double)(mono_ns() - start) / 1000.0;
+}
+
+/*
+ * Pick the cheapest working backend for each metric: the native
+ * interfaces where the kernel has them and we have access, the command
+ * line tools otherwise.  The chosen backend is called once to warm up
+ * (buffer sizing, opening devices) and once more to measure its cost.
+ */
+static void
+probe_backends(struct watch *w)
+{
+    uint64_t t0;
+    nvlist_t *nvl;
+
+    if (w->cfg->show_xruns && w->num_mons > 0) {
+        struct channel_xruns probe[MIN_CHANNELS];
+        int unit = w->mons[0].dev->unit;
+        int ok = 0;
+
+        if ((nvl = fetch_channels()) != NULL) {
+            ok = get_xruns_nv(nvl, unit, 0, probe, MIN_CHANNELS) >= 0;
+            nvlist_destroy(nvl);
+        }
+
+        if (ok) {
+            t0 = mono_ns();
+            if ((nvl = fetch_channels()) != NULL) {
+                get_xruns_nv(nvl, unit, 0, probe, MIN_CHANNELS);
+                nvlist_destroy(nvl);
+            }
+            w->xruns_be = (struct backend){ BACKEND_NATIVE, "sndstat", elapsed_us(t0) };
+        } else {
+            t0 = mono_ns();
+            get_xruns_cmd(unit, 0, probe, MIN_CHANNELS);
+            w->xruns_be = (struct backend){ BACKEND_CMD, "sndctl", elapsed_us(t0) };
+        }
+    }
+
+#ifndef WITHOUT_USB
+    if (w->num_usb > 0) {
+        struct usb_source *u = &w->usbs[0];
+        struct usb_stats st;
+
+        /* Every source on its own, the first one is measured */
+        for (int i = 0; i < w->num_usb; i++)
+            usb_probe_native(&w->usbs[i]);
+        if (u->native) {
+            get_usb_stats(u->node, &u->fd, &st);
+            t0 = mono_ns();
+            get_usb_stats(u->node, &u->fd, &st);
+            w->usb_be = (struct backend){ BACKEND_NATIVE, "ioctl", elapsed_us(t0) };
+        } else {
+            t0 = mono_ns();
+            get_usb_stats_cmd(u->node, &st);
+            w->usb_be = (struct backend){ BACKEND_CMD, "usbconfig", elapsed_us(t0) };
+        }
+    }
+#endif
+
+    if (HAVE_IRQ && w->num_irq > 0) {
+        t0 = mono_ns();
+        if (intrtab.counts != NULL && intr_table_refresh(&intrtab) == 0) {
+            w->irq_be = (struct backend){ BACKEND_NATIVE, "sysctl", elapsed_us(t0) };
+        } else {
+            /* Every source falls back to vmstat on its own */
+            for (int i = 0; i < w->num_irq; i++)
+                w->irqs[i].index = -1;
+            t0 = mono_ns();
+            get_irq_count_cmd(w->irqs[0].irq);
+            w->irq_be = (struct backend){ BACKEND_CMD, "vmstat", elapsed_us(t0) };
+        }
+    }
+}
+
+/* Show the chosen backends in the watch header */
+static void
+print_backends(const struct watch *w)
+{
+    const struct {
+        const char *metric;
+        const struct backend *be;
+    } list[] = {
+        { "xruns", &w->xruns_be },
+        { "usb", &w->usb_be },
+        { "irq", &w->irq_be },
+    };
+    int n = 0;
+
+    for (size_t i = 0; i < sizeof(list) / sizeof(list[0]); i++) {
+        if (list[i].be->kind == BACKEND_NONE)
+            continue;
+        fprintf(w->info, "%s %s=%s (%.0fus)", n++ > 0 ? "," : "Backends:",
+                list[i].metric, list[i].be->name, list[i].be->cost_us);
+    }
+    if (n > 0)
+        fprintf(w->info, "\n");
+}
+
+/*
+ * Channel slots per device: every vchan the kernel may create in each
+ * direction (hw.snd.maxautovchans) plus room for hardware channels.
+ */
+static int
+channel_capacity(void)
+{
+    int vchans = sysctl_get_int("hw.snd.maxautovchans");
+    int n = 2 * ((vchans > 0 ? vchans : 16) + 4);
+
+    return n > MIN_CHANNELS ? n : MIN_CHANNELS;
+}
+
+/*
+ * Set up watch state for the target devices and print the header.
+ * Sources shared between devices (a USB device or controller used by
+ * several pcm units) are collected once.
+ */
+static int
+watch_init(struct watch *w, struct config *cfg, struct pcm_device **targets,
+           int ntargets, int max_channels)
+{
+    memset(w, 0, sizeof(*w));
+    w->cfg = cfg;
+    w->info = cfg->output != OUTPUT_TEXT ? stderr : stdout;
+    w->num_mons = ntargets;
+    w->max_channels = max_channels;
+    w->devd_fd = -1;
+    w->kq = -1;
+    rollup_init(&w->roll);
+
+    /* Each device adds at most one USB and one IRQ source */
+    w->mons = arena_alloc(&w->arena, ntargets * sizeof(*w->mons));
+    w->usbs = arena_alloc(&w->arena, ntargets * sizeof(*w->usbs));
+    w->irqs = arena_alloc(&w->arena, ntargets * sizeof(*w->irqs));
+    w->prev_xruns = arena_alloc(&w->arena, max_channels * sizeof(*w->prev_xruns));
+    if (w->mons == NULL || w->usbs == NULL || w->irqs == NULL || w->prev_xruns == NULL)
+        return -1;
+
+    /* The scan isn't part of a trace, so only when watching live */
+    if (HAVE_IRQ && cfg->irq_top > 0 && !cfg->offline &&
+        (w->scan = intr_scan_init(&w->arena)) == NULL)
+        fprintf(stderr, "Warning: interrupt table not available, -I disabled\n");
+
+    /* CPU load and bindings aren't in traces either */
+    if (cfg->cpu_attr && !cfg->offline) {
+        if ((w->ncpu = cp_times_ncpu()) == 0) {
+            fprintf(stderr, "Warning: kern.cp_times not available, -C disabled\n");
+        } else {
+            size_t n = (size_t)w->ncpu * CPUSTATES;
+
+            w->prev_cp_times = arena_alloc(&w->arena, n * sizeof(*w->prev_cp_times));
+            w->cpu_busy = arena_alloc(&w->arena, w->ncpu * sizeof(*w->cpu_busy));
+            w->cpu_intr = arena_alloc(&w->arena, w->ncpu * sizeof(*w->cpu_intr));
+            if (w->prev_cp_times == NULL || w->cpu_busy == NULL || w->cpu_intr == NULL)
+                return -1;
+        }
+    }
+
+    /* Sub-second intervals get millisecond timestamps */
+    w->msec = cfg->interval < 1.0;
+    w->period = (uint64_t)(cfg->interval * NSEC_PER_SEC);
+
+    for (int i = 0; i < ntargets; i++) {
+        struct pcm_device *dev = targets[i];
+        int j;
+
+        w->mons[i].dev = dev;
+        w->mons[i].unit = dev->unit;
+        w->mons[i].usb = -1;
+        /* Room for channels that come and go, e.g. vchans */
+        if (chan_table_init(&w->mons[i].chans, &w->arena, 2 * max_channels,
+                            max_channels) < 0)
+            return -1;
+        fprintf(w->info, "Monitoring pcm%d: %s\n", dev->unit, dev->desc);
+
+        if (!dev->is_usb || !cfg->show_usb)
+            continue;
+
+        fprintf(w->info, "USB device: ugen%s\n", dev->ugen);
+        if (dev->controller[0])
+            fprintf(w->info, "USB controller: %s (%s)\n", dev->controller, dev->irq);
+
+#ifndef WITHOUT_USB
+        for (j = 0; j < w->num_usb; j++) {
+            if (strcmp(w->usbs[j].ugen, dev->ugen) == 0)
+                break;
+        }
+        if (j == w->num_usb) {
+            struct usb_source *u = &w->usbs[w->num_usb++];
+
+            snprintf(u->ugen, sizeof(u->ugen), "%s", dev->ugen);
+            snprintf(u->node, sizeof(u->node), "%s", dev->ugen);
+            if (ntargets > 1)
+                snprintf(u->label, sizeof(u->label), "ugen%s ", dev->ugen);
+            u->fd = -1;
+
+            /* To find the device again if it comes back elsewhere */
+            if (!cfg->offline && usb_ident_read(u->node, &u->id) == 0)
+                fprintf(w->info, "USB id: %04x:%04x%s%s\n", u->id.vendor, u->id.product,
+                        u->id.serial[0] ? " serial " : "", u->id.serial);
+        }
+        if (j < w->num_usb)
+            w->mons[i].usb = j;
+#endif
+
+        if (!HAVE_IRQ || !dev->irq[0])
+            continue;
+
+        for (j = 0; j < w->num_irq; j++) {
+            if (strcmp(w->irqs[j].controller, dev->controller) == 0)
+                break;
+        }
+        if (j == w->num_irq) {
+            struct irq_source *q = &w->irqs[w->num_irq++];
+
+            snprintf(q->controller, sizeof(q->controller), "%s", dev->controller);
+            snprintf(q->irq, sizeof(q->irq), "%s", dev->irq);
+            q->index = dev->irq_index;
+            q->num = irq_number(dev->irq);
+            q->cpu = -1;
+        }
+    }
+    
+    /* Replay doesn't touch the hardware */
+    if (!cfg->offline) {
+        probe_backends(w);
+        print_backends(w);
+    }
+
+    /* Buffer levels only come with the sndstat channel info */
+    if (cfg->buf_probe > 0 && !cfg->offline) {
+        size_t n = (size_t)ntargets * max_channels;
+
+        if (w->xruns_be.kind != BACKEND_NATIVE) {
+            fprintf(stderr, "Warning: channel buffer info not available, -b disabled\n");
+        } else {
+            w->num_bufs = arena_alloc(&w->arena, ntargets * sizeof(*w->num_bufs));
+            w->bufs = arena_alloc(&w->arena, n * sizeof(*w->bufs));
+            w->num_worst = arena_alloc(&w->arena, ntargets * sizeof(*w->num_worst));
+            w->buf_worst = arena_alloc(&w->arena, n * sizeof(*w->buf_worst));
+            if (w->num_bufs == NULL || w->bufs == NULL ||
+                w->num_worst == NULL || w->buf_worst == NULL)
+                return -1;
+            fprintf(w->info, "Buffer probe: every %.0f ms\n", cfg->buf_probe * 1000);
+        }
+    }
+
+    /* Only what is compiled in and needed is sampled */
+    for (size_t i = 0; i < sizeof(collectors) / sizeof(collectors[0]); i++) {
+        if (collectors[i].enabled(w))
+            w->active[w->num_active++] = &collectors[i];
+    }
+
+    fprintf(w->info, "----------------------------------------\n");
+    if (cfg->output == OUTPUT_CSV)
+        printf("mono_ns,wall,event,source,from,to,score,detail\n");
+    return 0;
+}
+
+/*
+ * Main watch loop.  Shared sources (the sndstat channel list, the
+ * interrupt table, each USB device and controller) are sampled once per
+ * tick.  With cfg->threaded, sampling runs in its own thread and output
+ * never delays the next sample.
+ */
+static void
+watch_loop(struct config *cfg, struct pcm_device **targets, int ntargets)
+{
+    static struct watch w;
+    static struct sample smp;
+    struct trace trace;
+
+    if (watch_init(&w, cfg, targets, ntargets, channel_capacity()) < 0 ||
+        sample_init(&w, &smp) < 0) {
+        perror("Cannot allocate watch state");
+        arena_free(&w.arena);
+        return;
+    }
+
+    if (cfg->record_file != NULL) {
+        if (trace_create(&trace, cfg->record_file, cfg->record_mb, &w) < 0) {
+            fprintf(stderr, "Cannot create trace %s: %s\n",
+                    cfg->record_file, strerror(errno));
+            arena_free(&w.arena);
+            return;
+        }
+        w.trace = &trace;
+        fprintf(w.info, "Recording %ju samples to %s\n",
+               (uintmax_t)trace.hdr->capacity, cfg->record_file);
+    }
+
+    /* Print initial values */
+    take_sample(&w, &smp);
+    if (w.trace != NULL)
+        trace_write(w.trace, &w, &smp);
+    report_sample(&w, &smp);
+    fflush(stdout);
+
+    /* USB hotplug is reported as soon as devd sees it */
+#ifndef WITHOUT_USB
+    if (w.num_usb > 0)
+        w.devd_fd = devd_connect();
+#endif
+
+    /* Timer starts now, ticks are due at whole periods from here */
+    w.deadline = mono_ns();
+    if ((w.kq = setup_events(w.period, w.bufs != NULL ?
+                             (uint64_t)(cfg->buf_probe * NSEC_PER_SEC) : 0,
+                             w.devd_fd)) < 0) {
+        perror("kqueue");
+        running = 0;
+    }
+
+    if (running && cfg->daemon) {
+        if ((w.shm = shm_publish()) == NULL) {
+            running = 0;
+        } else {
+            w.metrics = &w.shm->metrics;
+            metrics_render(&w);
+            fprintf(w.info, "Publishing metrics in shared memory %s\n", SHM_NAME);
+        }
+    }
+
+#ifndef WITHOUT_EXPORTER
+    if (running && cfg->metrics_addr != NULL) {
+        static struct exporter exporter;
+        static struct metrics_buf metrics;
+
+        /* The exporter serves the same snapshot as the shared memory */
+        exporter.metrics = w.metrics != NULL ? w.metrics : &metrics;
+        if (exporter_start(&exporter, cfg->metrics_addr, w.kq) < 0) {
+            running = 0;
+        } else {
+            w.exporter = &exporter;
+            w.metrics = exporter.metrics;
+            metrics_render(&w);
+            fprintf(w.info, "Serving metrics on http://%s/metrics\n", cfg->metrics_addr);
+        }
+    }
+#endif
 
-        /* Parse description (after ": ") */
-        char *desc_start = strchr(line, ':');
-        if (desc_start) {
-            desc_start += 2; /* skip ": " */
-            char *newline = strchr(desc_start, '\n');
-            if (newline) *newline = '\0';
-            strncpy(dev->desc, desc_start, sizeof(dev->desc) - 1);
+    if (running && cfg->stress) {
+        char desc[192];
+
+        if ((w.stress = stress_start(&w)) == NULL) {
+            running = 0;
+        } else {
+            stress_describe(w.stress, 0, desc, sizeof(desc));
+            fprintf(w.info, "Stress: %.0f s per level, starting at %s\n",
+                    cfg->stress_step, desc);
         }
+    }
 
-        /* Check if default */
-        dev->is_default = (dev->unit == default_unit);
+    if (running && cfg->nsweep > 0) {
+        char desc[160];
 
-        /* Check if USB and get ugen */
-        if (find_usb_for_pcm(dev->unit, dev->ugen, sizeof(dev->ugen)) == 0) {
-            dev->is_usb = 1;
-            find_usb_controller(dev->ugen, dev->controller, sizeof(dev->controller),
-                               dev->irq, sizeof(dev->irq));
+        if ((w.sweep = sweep_start(&w)) == NULL) {
+            running = 0;
+        } else {
+            sweep_describe(w.sweep, 0, desc, sizeof(desc));
+            fprintf(w.info, "Sweep: %d settings, %.0f s each, starting with %s\n",
+                    w.sweep->nsteps, cfg->soak, desc);
+        }
+    }
+
+    if (running && cfg->threaded) {
+        pthread_t tid;
+
+        int ok;
+
+        w.ring.slots = arena_alloc(&w.arena, RING_SLOTS * sizeof(*w.ring.slots));
+        ok = w.ring.slots != NULL && sample_init(&w, &w.ring.spare) == 0;
+        for (int i = 0; ok && i < RING_SLOTS; i++)
+            ok = sample_init(&w, &w.ring.slots[i]) == 0;
+
+        if (!ok || sem_init(&w.ring.avail, 0, 0) < 0) {
+            perror("Cannot allocate sample ring");
+            running = 0;
+        } else {
+            if ((errno = pthread_create(&tid, NULL, sampler_thread, &w)) != 0) {
+                perror("Cannot start sampler thread");
+            } else {
+                reporter_loop(&w);
+                pthread_join(tid, NULL);
+            }
+            running = 0;
+            sem_destroy(&w.ring.avail);
         }
+    }
 
-        count++;
+    /* Main loop, idle in kevent() between events */
+    while (running) {
+        int r = next_event(&w, &smp);
+
+        if (r < 0)
+            break;
+        if (r > 0) {
+            report_sample(&w, &smp);
+            fflush(stdout);
+        }
     }
 
-    fclose(fp);
-    return count;
+#ifndef WITHOUT_EXPORTER
+    if (w.exporter != NULL) {
+        for (int i = 0; i < HTTP_CLIENTS; i++) {
+            if (w.exporter->clients[i].fd >= 0)
+                http_close(&w.exporter->clients[i]);
+        }
+        close(w.exporter->listen_fd);
+    }
+#endif
+    if (w.shm != NULL)
+        shm_unpublish(w.shm);
+    if (w.stress != NULL && w.stress->nthreads > 0) {
+        /* Interrupted before the last level */
+        stress_stop(w.stress);
+        stress_summary(&w);
+    }
+    if (w.sweep != NULL && w.sweep->active) {
+        /* Interrupted, keep what was measured so far */
+        sweep_restore(w.sweep);
+        sweep_summary(&w);
+    }
+    if (w.kq >= 0)
+        close(w.kq);
+    if (w.devd_fd >= 0)
+        close(w.devd_fd);
+    for (int i = 0; i < w.num_usb; i++) {
+        if (w.usbs[i].fd >= 0)
+            close(w.usbs[i].fd);
+    }
+    if (w.trace != NULL)
+        trace_close(w.trace, 1);
+
+    incident_flush(&w);
+    fflush(stdout);
+    fprintf(w.info, "\nMonitoring stopped.\n");
+    print_latency(&w, &w.lat);
+    print_intr_top(&w);
+    print_buffers(&w);
+    print_rollups(&w);
+    fflush(stdout);
+    arena_free(&w.arena);
 }
 
-/* Print device list */
+/*
+ * Synthetic counters for -A: one USB device with a playback and a
+ * recording channel, on a controller with a steady, slightly noisy
+ * interrupt rate.  Xruns, isochronous failures, interrupt spikes and
+ * counter restarts are injected at fixed ticks and counted, so they can
+ * be compared with what the detection found.
+ */
+struct synth {
+    uint64_t tick;
+    uint32_t seed;
+    struct timespec start;
+    int xruns;
+    int iso_fail;
+    long irq;
+    unsigned long xruns_in;     /* injected so far */
+    unsigned long iso_in;
+    unsigned long spikes_in;
+    unsigned long resets_in;
+};
+
+/* Next tick of the synthetic source */
 static void
-print_devices(struct pcm_device *devices, int count)
+synth_sample(struct synth *s, const struct watch *w, struct sample *smp)
 {
-    printf("Available audio devices:\n\n");
+    uint64_t t = s->tick++;
+    uint64_t ns = s->start.tv_nsec + t * w->period;
+    int reset = t > 0 && t % SYNTH_RESET_EVERY == 0;
+    struct channel_xruns *ch = sample_channels(w, smp, 0);
 
-    for (int i = 0; i < count; i++) {
-        struct pcm_device *dev = &devices[i];
-        
-        printf("  pcm%d", dev->unit);
-        
-        if (dev->is_default)
-            printf(" (default)");
-        
-        if (dev->is_usb)
-            printf(" [usb:%s]", dev->ugen);
-        
-        printf(": %s\n", dev->desc);
+    smp->type = SAMPLE_TICK;
+    smp->ts = t * w->period;
+    smp->wall.tv_sec = s->start.tv_sec + ns / NSEC_PER_SEC;
+    smp->wall.tv_nsec = ns % NSEC_PER_SEC;
+    smp->late = 0;
+
+    /* The playback channel is reopened now and then */
+    if (reset) {
+        s->xruns = 1;
+        s->xruns_in++;
+        s->resets_in++;
+    } else if (t > 0 && t % SYNTH_XRUN_EVERY == 0) {
+        s->xruns += 2;
+        s->xruns_in += 2;
     }
+    smp->num_channels[0] = 2;
+    ch[0].xruns = s->xruns;
+    ch[1].xruns = 0;
 
-    printf("\n");
+    if (w->num_usb > 0) {
+        if (t > 0 && t % SYNTH_ISO_EVERY == 0) {
+            s->iso_fail += 2;
+            s->iso_in += 2;
+        }
+        smp->usb_ok[0] = 1;
+        smp->usb[0] = (struct usb_stats){ .iso_fail = s->iso_fail };
+    }
+
+    if (w->num_irq > 0) {
+        double rate;
+
+        /* 1% noise, the same sequence every run */
+        s->seed = s->seed * 1103515245 + 12345;
+        rate = SYNTH_IRQ_RATE * (0.99 + 0.02 * (s->seed >> 16) / 65536.0);
+        if (!reset && t > 2 * IRQ_CALIBRATION_SAMPLES && t % SYNTH_SPIKE_EVERY == 0) {
+            rate *= 4;
+            s->spikes_in++;
+        }
+        if (reset) {
+            s->irq = 0;
+            s->resets_in++;
+        }
+        s->irq += (long)(rate * w->period / NSEC_PER_SEC);
+        smp->irq[0] = s->irq;
+    }
 }
 
-/* Print usage */
-static void
-usage(const char *progname)
+/*
+ * Push n samples through report_sample() as fast as it takes them, from
+ * the synthetic source or, looping over it, a trace.  Output goes to
+ * /dev/null so the terminal isn't measured.  Returns the seconds taken.
+ */
+static double
+analysis_run(struct watch *w, struct sample *smp, struct synth *s,
+             const struct trace *t, uint64_t n)
 {
-    printf("usage: %s [-d device] [-p] [-xruns] [-usb] [-w] [-i interval] [-t threshold]\n\n", progname);
-    printf("Options:\n");
-    printf("  -d N      Monitor device pcmN (default: system default)\n");
-    printf("  -p        Show only playback channels\n");
-    printf("  -xruns    Show only xruns (no USB errors, no IRQ monitoring)\n");
-    printf("  -usb      Show only USB errors and IRQ monitoring (no xruns)\n");
-    printf("  -w        Watch mode - start monitoring\n");
-    printf("  -i SEC    Interval in seconds (default: 1)\n");
-    printf("  -t N      IRQ spike threshold multiplier (default: 1.5)\n");
-    printf("  -h        Show this help\n\n");
-    printf("Notes:\n");
-    printf("  Without -w, shows available devices and exits.\n");
-    printf("  IRQ monitoring is enabled when USB monitoring is active.\n");
-    printf("  Use -usb to monitor only USB errors and IRQ spikes.\n");
-    printf("  Use -xruns to monitor only audio buffer xruns (no IRQ).\n\n");
-    printf("Examples:\n");
-    printf("  %s              List available audio devices\n", progname);
-    printf("  %s -w           Monitor default device\n", progname);
-    printf("  %s -d 1 -w      Monitor pcm1\n", progname);
-    printf("  %s -d 0 -p -w   Monitor only playback xruns on pcm0\n", progname);
-    printf("  %s -xruns -w    Monitor only xruns\n", progname);
-    printf("  %s -usb -w      Monitor only USB errors and IRQ\n", progname);
-    printf("  %s -t 2.0 -w    Set IRQ spike threshold to 2x baseline\n", progname);
+    const struct trace_header *h = t != NULL ? t->hdr : NULL;
+    uint64_t first = 0, len = 0, span = 0, t0;
+    double secs;
+    int out, null;
+
+    if (h != NULL) {
+        first = h->count > h->capacity ? h->count - h->capacity : 0;
+        len = h->count - first;
+        trace_read(t, w, h->count - 1, smp);
+        span = smp->ts;
+        trace_read(t, w, first, smp);
+        span = span - smp->ts + w->period;
+    }
+
+    fflush(stdout);
+    out = dup(STDOUT_FILENO);
+    if ((null = open("/dev/null", O_WRONLY | O_CLOEXEC)) >= 0) {
+        dup2(null, STDOUT_FILENO);
+        close(null);
+    }
+
+    t0 = mono_ns();
+    for (uint64_t i = 0; i < n; i++) {
+        if (h != NULL) {
+            /* Later laps carry on where the trace ended */
+            uint64_t shift = i / len * span;
+            uint64_t ns;
+
+            trace_read(t, w, first + i % len, smp);
+            ns = smp->wall.tv_nsec + shift;
+            smp->ts += shift;
+            smp->wall.tv_sec += ns / NSEC_PER_SEC;
+            smp->wall.tv_nsec = ns % NSEC_PER_SEC;
+        } else {
+            synth_sample(s, w, smp);
+        }
+        report_sample(w, smp);
+    }
+    incident_flush(w);
+    fflush(stdout);
+    secs = (double)(mono_ns() - t0) / NSEC_PER_SEC;
+
+    if (out >= 0) {
+        dup2(out, STDOUT_FILENO);
+        close(out);
+    }
+    return secs;
 }
 
-/* Main watch loop */
-static void
-watch_loop(struct config *cfg, struct pcm_device *dev)
+/*
+ * Show the throughput of an analysis run and what was detected, next to
+ * what the synthetic source injected.  Returns -1 on a mismatch.
+ */
+static int
+print_analysis(const struct watch *w, const struct synth *s, uint64_t n, double secs)
 {
-    char timestamp[16];
-    struct channel_xruns channels[MAX_CHANNELS];
-    struct channel_xruns prev_channels[MAX_CHANNELS];
-    int num_channels = 0;
-    int prev_num_channels = 0;
-    
-    struct usb_stats usb, prev_usb;
-    memset(&prev_usb, 0, sizeof(prev_usb));
-    
-    long prev_irq_count = 0;
-    long irq_baseline = 0;
-    int irq_samples = 0;
+    const struct {
+        const char *name;
+        int shown;
+        double found;
+        unsigned long injected;
+    } rows[] = {
+        { "xruns", 1, w->roll.total[ROLL_XRUNS], s != NULL ? s->xruns_in : 0 },
+        { "usb iso fail", w->num_usb > 0, w->roll.total[ROLL_USB_ISO], s != NULL ? s->iso_in : 0 },
+        { "irq spikes", w->num_irq > 0, w->roll.total_spikes, s != NULL ? s->spikes_in : 0 },
+        { "counter resets", 1, w->resets, s != NULL ? s->resets_in : 0 },
+    };
+    int ret = 0;
 
-    /* Print header */
-    printf("Monitoring pcm%d: %s\n", dev->unit, dev->desc);
-    
-    if (dev->is_usb && cfg->show_usb) {
-        printf("USB device: ugen%s\n", dev->ugen);
-        if (dev->controller[0])
-            printf("USB controller: %s (%s)\n", dev->controller, dev->irq);
+    printf("\nAnalysis: %ju samples in %.3f s, %.0f samples/s, %.0f ns/sample\n\n",
+           (uintmax_t)n, secs, secs > 0 ? n / secs : 0, secs * 1e9 / n);
+    printf("%-16s %10s %10s\n", "Detection", "injected", "found");
+    for (size_t i = 0; i < sizeof(rows) / sizeof(rows[0]); i++) {
+        if (!rows[i].shown)
+            continue;
+        if (s == NULL) {
+            printf("%-16s %10s %10.0f\n", rows[i].name, "-", rows[i].found);
+            continue;
+        }
+        printf("%-16s %10lu %10.0f%s\n", rows[i].name, rows[i].injected, rows[i].found,
+               rows[i].found != rows[i].injected ? "  MISMATCH" : "");
+        if (rows[i].found != rows[i].injected)
+            ret = -1;
     }
-    
-    printf("----------------------------------------\n");
 
-    /* Initialize USB stats */
-    if (dev->is_usb && cfg->show_usb) {
-        get_usb_stats(dev->ugen, &prev_usb);
+    return ret;
+}
+
+/* Benchmark the detection with the synthetic source (-A) */
+static int
+run_analysis(struct config *cfg)
+{
+    static struct watch w;
+    static struct sample smp;
+    struct pcm_device dev = { .unit = 0, .is_usb = 1, .irq_index = -1 };
+    struct pcm_device *target = &dev;
+    struct synth s = { .seed = 1 };
+    struct channel_xruns *ch;
+    double secs;
+    int ret;
+
+    snprintf(dev.desc, sizeof(dev.desc), "<synthetic>");
+    snprintf(dev.ugen, sizeof(dev.ugen), "0.1");
+    snprintf(dev.controller, sizeof(dev.controller), "synth0");
+    snprintf(dev.irq, sizeof(dev.irq), "irq0");
+
+    /* Like a replay, watch_init() leaves the hardware alone */
+    cfg->offline = 1;
+    if (watch_init(&w, cfg, &target, 1, 2) < 0 || sample_init(&w, &smp) < 0) {
+        perror("Cannot allocate watch state");
+        arena_free(&w.arena);
+        return 1;
+    }
+
+    ch = sample_channels(&w, &smp, 0);
+    snprintf(ch[0].name, sizeof(ch[0].name), "pcm0.play.0");
+    snprintf(ch[1].name, sizeof(ch[1].name), "pcm0.record.0");
+    clock_gettime(CLOCK_REALTIME, &s.start);
+
+    secs = analysis_run(&w, &smp, &s, NULL, cfg->analysis);
+    ret = print_analysis(&w, &s, cfg->analysis, secs);
+    if (ret < 0)
+        fprintf(stderr, "Error: detection differs from the injected events\n");
+
+    arena_free(&w.arena);
+    return ret < 0 ? 1 : 0;
+}
+
+/* Run a recorded trace through the same detection as watch_loop() */
+static int
+replay_trace(struct config *cfg)
+{
+    static struct watch w;
+    static struct sample smp;
+    struct pcm_device *devices;
+    struct pcm_device **targets;
+    struct trace trace;
+    const struct trace_header *h;
+    uint64_t first;
+    int ret = 1;
+
+    if (trace_open(&trace, cfg->replay_file) < 0) {
+        fprintf(stderr, "Cannot open trace %s: %s\n",
+                cfg->replay_file, strerror(errno));
+        return 1;
     }
+    h = trace.hdr;
+
+    /* Settings from the recording, thresholds from the command line */
+    cfg->interval = h->interval;
+    cfg->play_only = h->play_only;
+    cfg->show_xruns = h->show_xruns;
+    cfg->show_usb = h->show_usb;
+    cfg->offline = 1;
 
-    /* Initialize IRQ count */
-    if (dev->irq[0] && cfg->show_usb) {
-        prev_irq_count = get_irq_count(dev->irq);
+    devices = calloc(h->num_devices, sizeof(*devices));
+    targets = calloc(h->num_devices, sizeof(*targets));
+    if (devices == NULL || targets == NULL) {
+        perror("Cannot allocate devices");
+        goto out;
     }
 
-    /* Print initial values */
-    get_timestamp(timestamp, sizeof(timestamp));
+    for (int i = 0; i < h->num_devices; i++) {
+        struct pcm_device *dev = &devices[i];
 
-    if (cfg->show_xruns) {
-        num_channels = get_xruns(dev->unit, cfg->play_only, channels, MAX_CHANNELS);
-        printf("[%s] Initial xruns:", timestamp);
-        for (int i = 0; i < num_channels; i++) {
-            printf(" %s=%d", channels[i].name, channels[i].xruns);
-        }
-        printf("\n");
-        
-        memcpy(prev_channels, channels, sizeof(channels));
-        prev_num_channels = num_channels;
+        dev->unit = h->devices[i].unit;
+        dev->is_usb = h->devices[i].is_usb;
+        snprintf(dev->desc, sizeof(dev->desc), "%.*s",
+                 (int)sizeof(h->devices[i].desc), h->devices[i].desc);
+        snprintf(dev->ugen, sizeof(dev->ugen), "%.*s",
+                 (int)sizeof(h->devices[i].ugen), h->devices[i].ugen);
+        snprintf(dev->controller, sizeof(dev->controller), "%.*s",
+                 (int)sizeof(h->devices[i].controller), h->devices[i].controller);
+        snprintf(dev->irq, sizeof(dev->irq), "%.*s",
+                 (int)sizeof(h->devices[i].irq), h->devices[i].irq);
+        dev->irq_index = -1;
+        targets[i] = dev;
+    }
+
+    first = h->count > h->capacity ? h->count - h->capacity : 0;
+    fprintf(cfg->output != OUTPUT_TEXT ? stderr : stdout, "Replaying %ju samples from %s\n",
+            (uintmax_t)(h->count - first), cfg->replay_file);
+
+    if (watch_init(&w, cfg, targets, h->num_devices, h->max_channels) < 0 ||
+        sample_init(&w, &smp) < 0) {
+        perror("Cannot allocate watch state");
+        goto out;
+    }
+
+    if (h->record_size != trace_record_size(w.num_mons, w.max_channels,
+                                            w.num_usb, w.num_irq)) {
+        fprintf(stderr, "Error: %s: trace record size mismatch\n", cfg->replay_file);
+        goto out;
     }
 
-    if (cfg->show_usb && dev->is_usb) {
-        printf("[%s] Initial USB: CTRL=%d ISO=%d BULK=%d INT=%d\n",
-               timestamp, prev_usb.ctrl_fail, prev_usb.iso_fail,
-               prev_usb.bulk_fail, prev_usb.int_fail);
+    if (cfg->analysis > 0) {
+        if (h->count > first) {
+            double secs = analysis_run(&w, &smp, NULL, &trace, cfg->analysis);
 
-        if (dev->irq[0]) {
-            printf("[%s] Initial IRQ: calibrating...\n", timestamp);
+            print_analysis(&w, NULL, cfg->analysis, secs);
+            ret = 0;
         }
+        goto out;
     }
 
-    /* Main loop */
-    while (running) {
-        sleep(cfg->interval);
-        
-        if (!running)
-            break;
+    for (uint64_t n = first; n < h->count; n++) {
+        trace_read(&trace, &w, n, &smp);
+        report_sample(&w, &smp);
+    }
 
-        get_timestamp(timestamp, sizeof(timestamp));
+    incident_flush(&w);
+    fflush(stdout);
+    fprintf(w.info, "\nReplay finished.\n");
+    print_latency(&w, &w.lat);
+    print_rollups(&w);
+    fflush(stdout);
+    ret = 0;
 
-        /* Check xruns */
-        if (cfg->show_xruns) {
-            num_channels = get_xruns(dev->unit, cfg->play_only, channels, MAX_CHANNELS);
-            
-            for (int i = 0; i < num_channels; i++) {
-                if (channels[i].xruns == 0)
-                    continue;
+out:
+    trace_close(&trace, 0);
+    arena_free(&w.arena);
+    free(targets);
+    free(devices);
+    return ret;
+}
 
-                /* Find previous value */
-                int prev_val = 0;
-                for (int j = 0; j < prev_num_channels; j++) {
-                    if (strcmp(channels[i].name, prev_channels[j].name) == 0) {
-                        prev_val = prev_channels[j].xruns;
-                        break;
-                    }
-                }
+/* State shared by the benchmarked collectors */
+struct bench_ctx {
+    struct pcm_device *dev;
+    struct channel_xruns *channels;
+    int max_channels;
+    int usb_fd;
+    struct irq_source irq;
+};
 
-                if (channels[i].xruns != prev_val) {
-                    int diff = channels[i].xruns - prev_val;
-                    printf("[%s] %s xruns: %d -> %d (+%d)\n",
-                           timestamp, channels[i].name,
-                           prev_val, channels[i].xruns, diff);
-                }
-            }
+static int
+bench_xruns_native(struct bench_ctx *b)
+{
+    nvlist_t *nvl = fetch_channels();
+    int n;
 
-            memcpy(prev_channels, channels, sizeof(channels));
-            prev_num_channels = num_channels;
-        }
+    if (nvl == NULL)
+        return -1;
+    n = get_xruns_nv(nvl, b->dev->unit, 0, b->channels, b->max_channels);
+    nvlist_destroy(nvl);
+    return n;
+}
 
-        /* Check USB errors */
-        if (cfg->show_usb && dev->is_usb) {
-            if (get_usb_stats(dev->ugen, &usb) < 0) {
-                printf("[%s] USB WARNING: Device disconnected or not responding\n",
-                       timestamp);
-            } else {
-                if (usb.ctrl_fail != prev_usb.ctrl_fail) {
-                    int diff = usb.ctrl_fail - prev_usb.ctrl_fail;
-                    printf("[%s] UE_CONTROL_FAIL: %d -> %d (+%d)\n",
-                           timestamp, prev_usb.ctrl_fail, usb.ctrl_fail, diff);
-                    prev_usb.ctrl_fail = usb.ctrl_fail;
-                }
+static int
+bench_xruns_cmd(struct bench_ctx *b)
+{
+    return get_xruns_cmd(b->dev->unit, 0, b->channels, b->max_channels) > 0 ? 0 : -1;
+}
 
-                if (usb.iso_fail != prev_usb.iso_fail) {
-                    int diff = usb.iso_fail - prev_usb.iso_fail;
-                    printf("[%s] UE_ISOCHRONOUS_FAIL: %d -> %d (+%d)\n",
-                           timestamp, prev_usb.iso_fail, usb.iso_fail, diff);
-                    prev_usb.iso_fail = usb.iso_fail;
-                }
+#ifndef WITHOUT_USB
+static int
+bench_usb_native(struct bench_ctx *b)
+{
+    struct usb_device_stats st;
+    char path[32];
 
-                if (usb.bulk_fail != prev_usb.bulk_fail) {
-                    int diff = usb.bulk_fail - prev_usb.bulk_fail;
-                    printf("[%s] UE_BULK_FAIL: %d -> %d (+%d)\n",
-                           timestamp, prev_usb.bulk_fail, usb.bulk_fail, diff);
-                    prev_usb.bulk_fail = usb.bulk_fail;
-                }
+    if (!b->dev->is_usb)
+        return -1;
 
-                if (usb.int_fail != prev_usb.int_fail) {
-                    int diff = usb.int_fail - prev_usb.int_fail;
-                    printf("[%s] UE_INTERRUPT_FAIL: %d -> %d (+%d)\n",
-                           timestamp, prev_usb.int_fail, usb.int_fail, diff);
-                    prev_usb.int_fail = usb.int_fail;
-                }
-            }
-        }
+    /* Without access get_usb_stats() would measure usbconfig instead */
+    if (b->usb_fd < 0) {
+        snprintf(path, sizeof(path), "/dev/ugen%s", b->dev->ugen);
+        if ((b->usb_fd = open(path, O_RDWR | O_CLOEXEC)) < 0)
+            return -1;
+    }
+    return ioctl(b->usb_fd, USB_DEVICESTATS, &st);
+}
+
+static int
+bench_usb_cmd(struct bench_ctx *b)
+{
+    struct usb_stats st;
 
-        /* Check IRQ rate */
-        if (dev->irq[0] && cfg->show_usb) {
-            long curr_irq_count = get_irq_count(dev->irq);
-            long irq_rate = curr_irq_count - prev_irq_count;
+    if (!b->dev->is_usb)
+        return -1;
+    return get_usb_stats_cmd(b->dev->ugen, &st);
+}
+#endif
 
-            /* Build baseline over first N samples */
-            if (irq_samples < IRQ_CALIBRATION_SAMPLES) {
-                irq_samples++;
-                irq_baseline = ((irq_baseline * (irq_samples - 1)) + irq_rate) / irq_samples;
+#ifndef WITHOUT_IRQ
+static int
+bench_irq_native(struct bench_ctx *b)
+{
+    if (b->irq.index < 0 || intr_table_refresh(&intrtab) < 0)
+        return -1;
+    return get_irq_count(&b->irq) >= 0 ? 0 : -1;
+}
 
-                if (irq_samples == IRQ_CALIBRATION_SAMPLES) {
-                    printf("[%s] %s baseline: %ld/s\n",
-                           timestamp, dev->controller, irq_baseline);
-                }
-            } else {
-                /* Check for spike */
-                if (irq_baseline > 0) {
-                    long threshold = (long)(irq_baseline * cfg->irq_threshold);
-                    if (irq_rate > threshold) {
-                        float ratio = (float)irq_rate / irq_baseline;
-                        printf("[%s] %s: %ld -> %ld/s (%.1fx)\n",
-                               timestamp, dev->controller,
-                               irq_baseline, irq_rate, ratio);
-                    }
-                }
-            }
+static int
+bench_irq_cmd(struct bench_ctx *b)
+{
+    if (b->irq.irq[0] == '\0')
+        return -1;
+    return get_irq_count_cmd(b->irq.irq) > 0 ? 0 : -1;
+}
+#endif
+
+static int
+bench_list_devices(struct bench_ctx *b)
+{
+    struct pcm_device *devices;
+    int n = list_devices(&devices);
+
+    (void)b;
+    free(devices);
+    return n > 0 ? 0 : -1;
+}
+
+/* CPU time of a rusage in microseconds */
+static double
+rusage_cpu_us(const struct rusage *ru)
+{
+    return ru->ru_utime.tv_sec * 1e6 + ru->ru_utime.tv_usec +
+           ru->ru_stime.tv_sec * 1e6 + ru->ru_stime.tv_usec;
+}
+
+/*
+ * Call every collector with each of its backends n times and report
+ * the cost per call: wall time, own and child CPU time, context
+ * switches and commands started.
+ */
+static int
+run_benchmark(struct pcm_device *dev, int n)
+{
+    static const struct {
+        const char *collector;
+        const char *backend;
+        int (*fn)(struct bench_ctx *);
+    } tests[] = {
+        { "get_xruns", "sndstat", bench_xruns_native },
+        { "get_xruns", "sndctl", bench_xruns_cmd },
+#ifndef WITHOUT_USB
+        { "get_usb_stats", "ioctl", bench_usb_native },
+        { "get_usb_stats", "usbconfig", bench_usb_cmd },
+#endif
+#ifndef WITHOUT_IRQ
+        { "get_irq_count", "sysctl", bench_irq_native },
+        { "get_irq_count", "vmstat", bench_irq_cmd },
+#endif
+        { "list_devices", "sndstat", bench_list_devices },
+    };
+    struct bench_ctx b = { .dev = dev, .usb_fd = -1 };
+
+    b.max_channels = channel_capacity();
+    if ((b.channels = calloc(b.max_channels, sizeof(*b.channels))) == NULL) {
+        perror("Cannot allocate channels");
+        return 1;
+    }
+    snprintf(b.irq.irq, sizeof(b.irq.irq), "%s", dev->irq);
+    b.irq.index = dev->irq_index;
 
-            prev_irq_count = curr_irq_count;
+    printf("Benchmark: %d calls per collector on pcm%d\n\n", n, dev->unit);
+    printf("%-14s %-10s %11s %11s %11s %9s %9s\n", "collector", "backend",
+           "wall/call", "cpu/call", "child/call", "csw/call", "cmd/call");
+
+    for (size_t t = 0; t < sizeof(tests) / sizeof(tests[0]); t++) {
+        struct rusage self0, self1, child0, child1;
+        unsigned long spawns0;
+        uint64_t t0, wall;
+        double csw;
+
+        /* Warm up, also tells if the backend works here */
+        if (tests[t].fn(&b) < 0) {
+            printf("%-14s %-10s %11s\n", tests[t].collector, tests[t].backend,
+                   "unavailable");
+            continue;
         }
+
+        getrusage(RUSAGE_SELF, &self0);
+        getrusage(RUSAGE_CHILDREN, &child0);
+        spawns0 = cmd_spawns;
+        t0 = mono_ns();
+
+        for (int i = 0; i < n; i++)
+            tests[t].fn(&b);
+
+        wall = mono_ns() - t0;
+        getrusage(RUSAGE_SELF, &self1);
+        getrusage(RUSAGE_CHILDREN, &child1);
+        csw = (self1.ru_nvcsw - self0.ru_nvcsw) + (self1.ru_nivcsw - self0.ru_nivcsw);
+
+        printf("%-14s %-10s %9.1fus %9.1fus %9.1fus %9.2f %9.2f\n",
+               tests[t].collector, tests[t].backend,
+               wall / 1e3 / n,
+               (rusage_cpu_us(&self1) - rusage_cpu_us(&self0)) / n,
+               (rusage_cpu_us(&child1) - rusage_cpu_us(&child0)) / n,
+               csw / n, (double)(cmd_spawns - spawns0) / n);
     }
 
-    printf("\nMonitoring stopped.\n");
+    if (b.usb_fd >= 0)
+        close(b.usb_fd);
+    free(b.channels);
+    return 0;
 }
 
 int
 main(int argc, char *argv[])
 {
     struct config cfg = {
-        .device = -1,
+        .num_units = 0,
+        .all_units = 0,
         .play_only = 0,
         .show_xruns = 1,
         .show_usb = 1,
         .watch_mode = 0,
-        .interval = 1,
-        .irq_threshold = 1.5f
+        .interval = 1.0,
+        .irq_threshold = 1.5f,
+        .irq_zscore = 3.0f,
+        .threaded = 0,
+        .sampler_cpu = -1,
+        .sampler_rtprio = -1,
+        .record_file = NULL,
+        .record_mb = TRACE_DEFAULT_MB,
+        .replay_file = NULL,
+        .corr_window = 0,
+        .stress_step = STRESS_STEP_DEFAULT,
+        .soak = SWEEP_SOAK_DEFAULT
     };
 
-    struct pcm_device devices[MAX_DEVICES];
+    struct pcm_device *devices;
     int num_devices;
 
     /* Parse arguments */
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
-            cfg.device = atoi(argv[++i]);
+            if (parse_units(argv[++i], &cfg) < 0) {
+                fprintf(stderr, "Error: invalid device list: %s\n", argv[i]);
+                return 1;
+            }
         } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
-            cfg.interval = atoi(argv[++i]);
+            cfg.interval = atof(argv[++i]);
+            if (cfg.interval < MIN_INTERVAL) {
+                fprintf(stderr, "Error: interval must be at least %g seconds\n", MIN_INTERVAL);
+                return 1;
+            }
         } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
             cfg.irq_threshold = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-z") == 0 && i + 1 < argc) {
+            cfg.irq_zscore = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-T") == 0) {
+            cfg.threaded = 1;
+        } else if (strcmp(argv[i], "-cpu") == 0 && i + 1 < argc) {
+            cfg.sampler_cpu = atoi(argv[++i]);
+            cfg.threaded = 1;
+        } else if (strcmp(argv[i], "-rtprio") == 0 && i + 1 < argc) {
+            cfg.sampler_rtprio = atoi(argv[++i]);
+            if (cfg.sampler_rtprio < 0 || cfg.sampler_rtprio > RTP_PRIO_MAX) {
+                fprintf(stderr, "Error: rtprio must be 0-%d\n", RTP_PRIO_MAX);
+                return 1;
+            }
+            cfg.threaded = 1;
+        } else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+            cfg.record_file = argv[++i];
+        } else if (strcmp(argv[i], "-Rsize") == 0 && i + 1 < argc) {
+            cfg.record_mb = strtoul(argv[++i], NULL, 10);
+            if (cfg.record_mb == 0) {
+                fprintf(stderr, "Error: invalid trace size: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            cfg.replay_file = argv[++i];
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            cfg.corr_window = atof(argv[++i]);
+            if (cfg.corr_window <= 0) {
+                fprintf(stderr, "Error: invalid correlation window: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "json") == 0)
+                cfg.output = OUTPUT_JSON;
+            else if (strcmp(argv[i], "csv") == 0)
+                cfg.output = OUTPUT_CSV;
+            else if (strcmp(argv[i], "text") == 0)
+                cfg.output = OUTPUT_TEXT;
+            else {
+                fprintf(stderr, "Error: unknown output format: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            if (!HAVE_EXPORTER) {
+                fprintf(stderr, "Error: built without the exporter (WITHOUT_EXPORTER)\n");
+                return 1;
+            }
+            cfg.metrics_addr = argv[++i];
+        } else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+            cfg.bench = atoi(argv[++i]);
+            if (cfg.bench <= 0) {
+                fprintf(stderr, "Error: invalid benchmark count: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-A") == 0 && i + 1 < argc) {
+            long long n = atoll(argv[++i]);
+
+            if (n <= 0) {
+                fprintf(stderr, "Error: invalid sample count: %s\n", argv[i]);
+                return 1;
+            }
+            cfg.analysis = n;
+        } else if (strcmp(argv[i], "-I") == 0 && i + 1 < argc) {
+            if (!HAVE_IRQ) {
+                fprintf(stderr, "Error: built without interrupt monitoring (WITHOUT_IRQ)\n");
+                return 1;
+            }
+            cfg.irq_top = atoi(argv[++i]);
+            if (cfg.irq_top <= 0) {
+                fprintf(stderr, "Error: invalid number of interrupt sources: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            cfg.buf_probe = atof(argv[++i]) / 1000;
+            if (cfg.buf_probe < MIN_INTERVAL) {
+                fprintf(stderr, "Error: invalid buffer probe period: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-D") == 0) {
+            cfg.daemon = 1;
+            cfg.watch_mode = 1;
+        } else if (strcmp(argv[i], "-q") == 0) {
+            return shm_query();
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            if ((cfg.stress = parse_stress(argv[++i])) == 0) {
+                fprintf(stderr, "Error: invalid stress list: %s\n", argv[i]);
+                return 1;
+            }
+            cfg.watch_mode = 1;
+        } else if (strcmp(argv[i], "-sstep") == 0 && i + 1 < argc) {
+            cfg.stress_step = atof(argv[++i]);
+            if (cfg.stress_step <= 0) {
+                fprintf(stderr, "Error: invalid stress step: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            if (cfg.nsweep == SWEEP_PARAMS ||
+                parse_sweep(argv[++i], &cfg.sweep[cfg.nsweep]) < 0) {
+                fprintf(stderr, "Error: invalid sweep: %s\n", argv[i]);
+                return 1;
+            }
+            cfg.nsweep++;
+            cfg.watch_mode = 1;
+        } else if (strcmp(argv[i], "-soak") == 0 && i + 1 < argc) {
+            cfg.soak = atof(argv[++i]);
+            if (cfg.soak <= 0) {
+                fprintf(stderr, "Error: invalid soak time: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-C") == 0) {
+            cfg.cpu_attr = 1;
+        } else if (strcmp(argv[i], "-v") == 0) {
+            cfg.verbose = 1;
         } else if (strcmp(argv[i], "-p") == 0) {
             cfg.play_only = 1;
         } else if (strcmp(argv[i], "-w") == 0) {
@@ -703,8 +6320,8 @@ main(int argc, char *argv[])
             cfg.show_xruns = 0;
             cfg.show_usb = 1;
         } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
-            num_devices = list_devices(devices, MAX_DEVICES);
-            print_devices(devices, num_devices);
+            num_devices = list_devices(&devices);
+            print_devices(devices, num_devices, cfg.verbose);
             usage(argv[0]);
             return 0;
         } else {
@@ -714,48 +6331,102 @@ main(int argc, char *argv[])
         }
     }
 
+    /* Records go out in large chunks, flushed once per tick */
+    if (cfg.output != OUTPUT_TEXT)
+        setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFSIZE);
+
+    /* Replay doesn't need the hardware, neither does the analysis benchmark */
+    if (cfg.replay_file != NULL)
+        return replay_trace(&cfg);
+    if (cfg.analysis > 0)
+        return run_analysis(&cfg);
+
     /* List devices */
-    num_devices = list_devices(devices, MAX_DEVICES);
+    num_devices = list_devices(&devices);
 
     /* If not watch mode, show devices and help */
-    if (!cfg.watch_mode) {
-        print_devices(devices, num_devices);
+    if (!cfg.watch_mode && cfg.bench == 0) {
+        print_devices(devices, num_devices, cfg.verbose);
         usage(argv[0]);
         return 0;
     }
 
-    /* Use default device if not specified */
-    if (cfg.device < 0) {
-        cfg.device = get_default_unit();
+    /* Pick devices to monitor */
+    struct pcm_device **targets = calloc(num_devices + cfg.num_units + 1,
+                                         sizeof(*targets));
+    int num_targets = 0;
+
+    if (targets == NULL) {
+        perror("Cannot allocate devices");
+        return 1;
     }
 
-    /* Find device in list */
-    struct pcm_device *target = NULL;
-    for (int i = 0; i < num_devices; i++) {
-        if (devices[i].unit == cfg.device) {
-            target = &devices[i];
-            break;
+    if (cfg.all_units) {
+        for (int i = 0; i < num_devices; i++)
+            targets[num_targets++] = &devices[i];
+    } else {
+        /* Use default device if not specified, units is only set by -d */
+        int default_unit = get_default_unit();
+        const int *units = cfg.num_units > 0 ? cfg.units : &default_unit;
+        int num_units = cfg.num_units > 0 ? cfg.num_units : 1;
+
+        for (int u = 0; u < num_units; u++) {
+            struct pcm_device *target = NULL;
+
+            /* Find device in list */
+            for (int i = 0; i < num_devices; i++) {
+                if (devices[i].unit == units[u]) {
+                    target = &devices[i];
+                    break;
+                }
+            }
+
+            if (target == NULL) {
+                fprintf(stderr, "Error: device pcm%d not found\n", units[u]);
+                return 1;
+            }
+            targets[num_targets++] = target;
         }
     }
 
-    if (target == NULL) {
-        fprintf(stderr, "Error: device pcm%d not found\n", cfg.device);
+    if (num_targets == 0) {
+        fprintf(stderr, "Error: no audio devices found\n");
         return 1;
     }
 
+    /* Only watched devices need their full topology */
+    for (int i = 0; i < num_targets; i++)
+        resolve_device(targets[i], 1);
+
+    if (cfg.bench > 0)
+        return run_benchmark(targets[0], cfg.bench);
+
     /* Check USB availability */
-    if (cfg.show_usb && !target->is_usb) {
-        fprintf(stderr, "Warning: Could not find USB device for pcm%d\n", cfg.device);
-        fprintf(stderr, "USB monitoring disabled.\n");
-        cfg.show_usb = 0;
+    if (cfg.show_usb) {
+        int have_usb = 0;
+
+        for (int i = 0; i < num_targets; i++) {
+            if (targets[i]->is_usb)
+                have_usb = 1;
+            else if (!cfg.all_units)
+                fprintf(stderr, "Warning: Could not find USB device for pcm%d\n",
+                        targets[i]->unit);
+        }
+
+        if (!have_usb) {
+            fprintf(stderr, "USB monitoring disabled.\n");
+            cfg.show_usb = 0;
+        }
     }
 
-    /* Setup signal handler */
-    signal(SIGINT, sigint_handler);
-    signal(SIGTERM, sigint_handler);
+    /* Detach before the kqueue and threads exist, they don't survive fork */
+    if (cfg.daemon && daemon(0, 1) < 0) {
+        perror("daemon");
+        return 1;
+    }
 
     /* Run watch loop */
-    watch_loop(&cfg, target);
+    watch_loop(&cfg, targets, num_targets);
 
     return 0;
 }